@@ -0,0 +1,81 @@
+#include <blockcache.hh>
+#include <blockindex.hh>
+
+BlockCache::BlockCache(qint64 given_capacity)
+{
+  capacity = given_capacity;
+  size = 0;
+  head = NO_SLOT;
+  tail = NO_SLOT;
+}
+
+bool
+BlockCache::Find(quint32 slot, QByteArray *data)
+{
+  QHash<quint32, Entry>::iterator it = entries.find(slot);
+  if (it == entries.end())
+    return false;
+
+  if (head != slot){
+    Unlink(it.value());
+    PushFront(slot, it.value());
+  }
+  *data = it.value().data;
+  return true;
+}
+
+void
+BlockCache::Insert(quint32 slot, const QByteArray& data)
+{
+  if (data.size() > capacity)
+    return;
+
+  Remove(slot);
+
+  while (size + data.size() > capacity && tail != NO_SLOT)
+    Remove(tail);
+
+  Entry& entry = entries[slot];
+  entry.data = data;
+  PushFront(slot, entry);
+  size += data.size();
+}
+
+void
+BlockCache::Remove(quint32 slot)
+{
+  QHash<quint32, Entry>::iterator it = entries.find(slot);
+  if (it == entries.end())
+    return;
+
+  Unlink(it.value());
+  size -= it.value().data.size();
+  entries.erase(it);
+}
+
+void
+BlockCache::Unlink(Entry& entry)
+{
+  if (entry.prev != NO_SLOT)
+    entries[entry.prev].next = entry.next;
+  else
+    head = entry.next;
+
+  if (entry.next != NO_SLOT)
+    entries[entry.next].prev = entry.prev;
+  else
+    tail = entry.prev;
+}
+
+void
+BlockCache::PushFront(quint32 slot, Entry& entry)
+{
+  entry.prev = NO_SLOT;
+  entry.next = head;
+
+  if (head != NO_SLOT)
+    entries[head].prev = slot;
+  else
+    tail = slot;
+  head = slot;
+}
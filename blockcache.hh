@@ -0,0 +1,56 @@
+#ifndef BLOCKCACHE_HH
+#define BLOCKCACHE_HH
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QHash>
+
+#define BLOCK_CACHE_SIZE (64 * 1024 * 1024)  // Bytes of served data blocks kept in memory
+
+/*
+ * Least recently used cache of data blocks, keyed by their slot in
+ * the block index. Blocks that many peers are fetching stay in
+ * memory, one-off reads age out, and the cache never holds more
+ * than its size in block data whatever the size of the files.
+ *
+ * The recency list is threaded through the entries by slot number,
+ * so a hit is one hash lookup and a couple of pointer updates.
+ */
+class BlockCache
+{
+public:
+  BlockCache(qint64 capacity);
+
+  bool
+  Find(quint32 slot, QByteArray *data);
+
+  void
+  Insert(quint32 slot, const QByteArray& data);
+
+  // Forget a block, its slot is about to be reused.
+  void
+  Remove(quint32 slot);
+
+private:
+
+  struct Entry
+  {
+    QByteArray data;
+    quint32 prev;
+    quint32 next;
+  };
+
+  void
+  Unlink(Entry& entry);
+
+  void
+  PushFront(quint32 slot, Entry& entry);
+
+  QHash<quint32, Entry> entries;
+  quint32 head;   // Most recently used
+  quint32 tail;   // Next to go
+  qint64 size;
+  qint64 capacity;
+};
+
+#endif // BLOCKCACHE_HH
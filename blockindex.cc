@@ -0,0 +1,189 @@
+#include <string.h>
+
+#include <blockindex.hh>
+
+#define TOMBSTONE 0xffffffff
+#define INITIAL_TABLE 1024  // Must be a power of two
+
+BlockIndex::BlockIndex()
+{
+  table.fill(0, INITIAL_TABLE);
+  tableMask = INITIAL_TABLE - 1;
+  used = 0;
+  tombstones = 0;
+  freeLocation = NO_LOCATION;
+}
+
+// The hashes are SHA-256 digests, their first bytes are as good
+// a table index as any.
+static inline quint32
+Bucket(const char *hash)
+{
+  quint32 bucket;
+  memcpy(&bucket, hash, sizeof(bucket));
+  return bucket;
+}
+
+// Table position holding this hash, or of the empty entry ending its run.
+quint32
+BlockIndex::Probe(const char *hash) const
+{
+  quint32 pos = Bucket(hash) & tableMask;
+  for(;; pos = (pos + 1) & tableMask){
+
+    quint32 entry = table[pos];
+    if (entry == 0)
+      return pos;
+
+    if (entry != TOMBSTONE &&
+	memcmp(digests.constData() + (qint64)(entry - 1) * HASH_SIZE, hash, HASH_SIZE) == 0)
+      return pos;
+  }
+}
+
+quint32
+BlockIndex::Find(const QByteArray& hash) const
+{
+  if (hash.size() != HASH_SIZE)
+    return NO_SLOT;
+
+  quint32 entry = table[Probe(hash.constData())];
+  return entry == 0 ? NO_SLOT : entry - 1;
+}
+
+quint32
+BlockIndex::Insert(const QByteArray& hash)
+{
+  quint32 slot = Find(hash);
+  if (slot != NO_SLOT || hash.size() != HASH_SIZE)
+    return slot;
+
+  if ((used + tombstones + 1) * 100 > (int)(tableMask + 1) * BLOCK_MAX_LOAD)
+    Grow();
+
+  if (!freeSlots.isEmpty()){
+
+    slot = freeSlots.last();
+    freeSlots.pop_back();
+    memcpy(digests.data() + (qint64)slot * HASH_SIZE, hash.constData(), HASH_SIZE);
+  }
+  else {
+
+    slot = refs.count();
+    digests.resize(digests.count() + HASH_SIZE);
+    memcpy(digests.data() + (qint64)slot * HASH_SIZE, hash.constData(), HASH_SIZE);
+    refs.append(0);
+    lengths.append(0);
+    levels.append(0);
+    firstLocation.append(NO_LOCATION);
+  }
+
+  refs[slot] = 0;
+  lengths[slot] = 0;
+  levels[slot] = 0;
+  firstLocation[slot] = NO_LOCATION;
+
+  // Reuse the first tombstone of the run, if there is one.
+  quint32 pos = Bucket(hash.constData()) & tableMask;
+  while (table[pos] != 0 && table[pos] != TOMBSTONE)
+    pos = (pos + 1) & tableMask;
+
+  if (table[pos] == TOMBSTONE)
+    --tombstones;
+  table[pos] = slot + 1;
+  ++used;
+  return slot;
+}
+
+void
+BlockIndex::Remove(quint32 slot)
+{
+  quint32 pos = Probe(digests.constData() + (qint64)slot * HASH_SIZE);
+  if (table[pos] != slot + 1)
+    return;
+
+  table[pos] = TOMBSTONE;
+  --used;
+  ++tombstones;
+
+  while (firstLocation[slot] != NO_LOCATION)
+    RemoveLocation(slot, locationFile[firstLocation[slot]]);
+
+  refs[slot] = 0;
+  freeSlots.append(slot);
+}
+
+int
+BlockIndex::Count() const
+{
+  return used;
+}
+
+QByteArray
+BlockIndex::Hash(quint32 slot) const
+{
+  return QByteArray(digests.constData() + (qint64)slot * HASH_SIZE, HASH_SIZE);
+}
+
+// Double the table (or just drop the tombstones) and reinsert every slot.
+void
+BlockIndex::Grow()
+{
+  quint32 size = tableMask + 1;
+  if (used * 100 * 2 > (int)size * BLOCK_MAX_LOAD)
+    size *= 2;
+
+  QVector<quint32> old = table;
+  table.fill(0, size);
+  tableMask = size - 1;
+  tombstones = 0;
+
+  for(int i = 0; i < old.count(); ++i){
+
+    if (old[i] == 0 || old[i] == TOMBSTONE)
+      continue;
+
+    quint32 pos = Bucket(digests.constData() + (qint64)(old[i] - 1) * HASH_SIZE) & tableMask;
+    while (table[pos] != 0)
+      pos = (pos + 1) & tableMask;
+    table[pos] = old[i];
+  }
+}
+
+void
+BlockIndex::AddLocation(quint32 slot, quint32 fileId, qint64 offset)
+{
+  quint32 loc = freeLocation;
+  if (loc != NO_LOCATION)
+    freeLocation = locationNext[loc];
+  else {
+
+    loc = locationFile.count();
+    locationFile.append(0);
+    locationOffset.append(0);
+    locationNext.append(NO_LOCATION);
+  }
+
+  locationFile[loc] = fileId;
+  locationOffset[loc] = offset;
+  locationNext[loc] = firstLocation[slot];
+  firstLocation[slot] = loc;
+}
+
+void
+BlockIndex::RemoveLocation(quint32 slot, quint32 fileId)
+{
+  quint32 *link = &firstLocation[slot];
+  while (*link != NO_LOCATION){
+
+    quint32 loc = *link;
+    if (locationFile[loc] == fileId){
+
+      *link = locationNext[loc];
+      locationNext[loc] = freeLocation;
+      freeLocation = loc;
+      return;
+    }
+    link = &locationNext[loc];
+  }
+}
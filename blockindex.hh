@@ -0,0 +1,95 @@
+#ifndef BLOCKINDEX_HH
+#define BLOCKINDEX_HH
+
+#include <fileconstants.hh>
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QVector>
+
+#define NO_SLOT 0xffffffff      // Returned by Find() for unknown hashes
+#define NO_LOCATION 0xffffffff  // End of a location chain
+#define BLOCK_MAX_LOAD 70       // Percentage of the table used before it grows
+
+/*
+ * Metadata for every unique block, kept as a struct of arrays. A
+ * block gets a 32-bit slot, and its hash, reference count, length
+ * and level live at that index in parallel arrays. An open-addressing
+ * table with linear probing maps a hash to its slot, so a lookup is
+ * a couple of sequential reads instead of a walk through heap nodes.
+ *
+ * A data block may be read from several files, its (file id, offset)
+ * pairs are chained in a location pool. Slots and locations are
+ * recycled through free lists, a slot stays valid for as long as
+ * its block is referenced.
+ *
+ * About 70 bytes per block: a million block share fits in ~70 MB.
+ */
+class BlockIndex
+{
+public:
+  BlockIndex();
+
+  quint32
+  Find(const QByteArray& hash) const;
+
+  // The slot for this hash, allocated (with no references) if new.
+  quint32
+  Insert(const QByteArray& hash);
+
+  void
+  Remove(quint32 slot);
+
+  int
+  Count() const;
+
+  QByteArray
+  Hash(quint32 slot) const;
+
+  quint32& Refs(quint32 slot) { return refs[slot]; }
+  quint32& Length(quint32 slot) { return lengths[slot]; }
+  quint8& Level(quint32 slot) { return levels[slot]; }
+
+  void
+  AddLocation(quint32 slot, quint32 fileId, qint64 offset);
+
+  void
+  RemoveLocation(quint32 slot, quint32 fileId);
+
+  // Walk the (file id, offset) pairs of a slot:
+  //   for(loc = FirstLocation(s); loc != NO_LOCATION; loc = NextLocation(loc))
+  quint32 FirstLocation(quint32 slot) const { return firstLocation[slot]; }
+  quint32 NextLocation(quint32 loc) const { return locationNext[loc]; }
+  quint32 LocationFile(quint32 loc) const { return locationFile[loc]; }
+  qint64 LocationOffset(quint32 loc) const { return locationOffset[loc]; }
+
+private:
+
+  quint32
+  Probe(const char *hash) const;
+
+  void
+  Grow();
+
+  // Hash table: 0 is empty, TOMBSTONE was removed, else slot + 1.
+  QVector<quint32> table;
+  quint32 tableMask;
+  int used;
+  int tombstones;
+
+  // One entry per slot.
+  QVector<char> digests;
+  QVector<quint32> refs;
+  QVector<quint32> lengths;
+  QVector<quint8> levels;
+  QVector<quint32> firstLocation;
+  QVector<quint32> freeSlots;
+
+  // Location pool, chained through locationNext.
+  QVector<quint32> locationFile;
+  QVector<qint64> locationOffset;
+  QVector<quint32> locationNext;
+  quint32 freeLocation;
+};
+
+#endif // BLOCKINDEX_HH
@@ -0,0 +1,147 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+
+#include <QDebug>
+#include <QMetaType>
+#include <QElapsedTimer>
+#include <QVariantMap>
+
+#include <blockserver.hh>
+#include <files.hh>
+#include <helper.hh>
+#include <router.hh>
+
+ServeTask::ServeTask(BlockServer *server, const ServeJob& job)
+{
+  m_server = server;
+  m_job = job;
+}
+
+void
+ServeTask::run()
+{
+  QElapsedTimer timer;
+  timer.start();
+
+  QByteArray data;
+  bool chunkList;
+  int level;
+  qint64 bytes = -1;
+
+  if (m_server->m_fs->ServeBlock(m_job.index, &data, &chunkList, &level)){
+
+    // What Router::sendMap() would send.
+    QVariantMap msg;
+    msg["BlockReply"] = m_job.index;
+    msg["Data"] = data;
+    if (chunkList)
+      msg["Chunked"] = true;
+    // Lists say how far they are above the data, 1 for a list of
+    // data blocks.
+    if (level > 0)
+      msg["Level"] = level;
+    msg["Dest"] = m_job.dest;
+    msg["HopLimit"] = HOP_LIMIT;
+    msg["Origin"] = m_job.origin;
+
+    if (m_server->Send(m_job, Helper::SerializeMap(msg)))
+      bytes = data.size();
+  }
+
+  QMetaObject::invokeMethod(m_server, "Complete", Qt::QueuedConnection,
+			    Q_ARG(QString, m_job.dest), Q_ARG(qint64, bytes),
+			    Q_ARG(qint64, timer.elapsed()));
+}
+
+
+
+BlockServer::BlockServer(FileStore *fs)
+{
+  qRegisterMetaType<qint64>("qint64");
+
+  m_fs = fs;
+  pending = 0;
+  pool.setMaxThreadCount(SERVE_THREADS);
+}
+
+BlockServer::~BlockServer()
+{
+  pool.waitForDone();
+}
+
+void
+BlockServer::Serve(const ServeJob& job)
+{
+  ++pending;
+  pool.start(new ServeTask(this, job));
+}
+
+int
+BlockServer::Pending()
+{
+  return pending;
+}
+
+void
+BlockServer::Complete(const QString& dest, qint64 bytes, qint64 msecs)
+{
+  --pending;
+  emit served(dest, bytes, msecs);
+}
+
+/*
+ * Send from a serving thread. The socket is non-blocking, when its
+ * buffer is full wait a little for room rather than drop the reply
+ * straight away.
+ */
+bool
+BlockServer::Send(const ServeJob& job, const QByteArray& datagram)
+{
+  struct sockaddr_storage addr;
+  socklen_t length;
+  memset(&addr, 0, sizeof(addr));
+
+  if (job.address.protocol() == QAbstractSocket::IPv6Protocol){
+
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+    Q_IPV6ADDR ip = job.address.toIPv6Address();
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(job.port);
+    memcpy(&in6->sin6_addr, &ip, sizeof(ip));
+    length = sizeof(*in6);
+  }
+  else {
+    struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(job.port);
+    in->sin_addr.s_addr = htonl(job.address.toIPv4Address());
+    length = sizeof(*in);
+  }
+
+  for(int tries = 0; tries < SEND_TRIES; ++tries){
+
+    ssize_t sent = ::sendto(job.socket, datagram.constData(), datagram.size(), 0,
+			    (struct sockaddr *)&addr, length);
+    if (sent == datagram.size())
+      return true;
+
+    if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS){
+
+      qDebug() << "Block server: couldn't send to " << job.dest << ": " << strerror(errno);
+      return false;
+    }
+
+    struct pollfd writable;
+    writable.fd = job.socket;
+    writable.events = POLLOUT;
+    writable.revents = 0;
+    ::poll(&writable, 1, SEND_WAIT);
+  }
+
+  qDebug() << "Block server: socket buffer full, dropped a block for " << job.dest;
+  return false;
+}
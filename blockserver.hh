@@ -0,0 +1,92 @@
+#ifndef BLOCKSERVER_HH
+#define BLOCKSERVER_HH
+
+#include <QObject>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QHostAddress>
+#include <QByteArray>
+#include <QString>
+
+#define SERVE_THREADS 4      // Threads reading and sending blocks
+#define SERVE_INFLIGHT 64    // Most blocks handed to them and not yet sent
+#define SEND_TRIES 4         // Times a thread waits for room in the socket buffer
+#define SEND_WAIT 20         //   and for how long (ms) each time
+
+class FileStore;
+class BlockServer;
+
+// Everything a serving thread needs to answer one block request,
+// the route is looked up beforehand on the event loop.
+struct ServeJob
+{
+  QByteArray index;
+  QString dest;
+  QString origin;
+  QHostAddress address;
+  quint16 port;
+  int socket;
+};
+
+class ServeTask : public QRunnable
+{
+public:
+  ServeTask(BlockServer *server, const ServeJob& job);
+
+  void
+  run();
+
+private:
+  BlockServer *m_server;
+  ServeJob m_job;
+};
+
+/*
+ * Answers block requests on SERVE_THREADS threads, away from the
+ * event loop that runs the GUI, gossip and Paxos. Each thread looks
+ * the block up (FileStore::ServeBlock), reads it, builds the reply
+ * and sends it itself, with sendto() on the node's socket, so
+ * replies still come from our one port.
+ *
+ * Every job is reported back on the event loop through served(),
+ * with what it sent and how long it took.
+ */
+class BlockServer : public QObject
+{
+  Q_OBJECT
+
+public:
+  BlockServer(FileStore *fs);
+  ~BlockServer();
+
+  void
+  Serve(const ServeJob& job);
+
+  // Jobs handed out and not yet reported back.
+  int
+  Pending();
+
+signals:
+
+  // bytes is -1 if the block couldn't be found or sent.
+  void
+  served(const QString& dest, qint64 bytes, qint64 msecs);
+
+public slots:
+
+  void
+  Complete(const QString& dest, qint64 bytes, qint64 msecs);
+
+private:
+
+  friend class ServeTask;
+
+  bool
+  Send(const ServeJob& job, const QByteArray& datagram);
+
+  FileStore *m_fs;
+  QThreadPool pool;
+  int pending;
+};
+
+#endif // BLOCKSERVER_HH
@@ -0,0 +1,423 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include <QDebug>
+#include <QMetaType>
+
+#include <diskio.hh>
+
+#ifdef HAVE_IO_URING
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int
+io_uring_register(int fd, unsigned opcode, void *arg, unsigned count)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+#endif // HAVE_IO_URING
+
+IoRing::IoRing()
+{
+  ringFd = -1;
+  pending = 0;
+  sqRing = cqRing = sqes = MAP_FAILED;
+}
+
+IoRing::~IoRing()
+{
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqesSize);
+  if (cqRing != MAP_FAILED && cqRing != sqRing)
+    munmap(cqRing, cqRingSize);
+  if (sqRing != MAP_FAILED)
+    munmap(sqRing, sqRingSize);
+  if (ringFd >= 0)
+    ::close(ringFd);
+}
+
+bool
+IoRing::Open(unsigned entries)
+{
+#ifdef HAVE_IO_URING
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ringFd = io_uring_setup(entries, &params);
+  if (ringFd < 0)
+    return false;
+
+  // Kernels before 5.6 have rings but no plain READ and WRITE, nor
+  // the probe: without both, use the thread pool.
+  if (!Supports(IORING_OP_READ) || !Supports(IORING_OP_WRITE)){
+
+    qDebug() << "io_uring: no READ or WRITE here, not using it";
+    ::close(ringFd);
+    ringFd = -1;
+    return false;
+  }
+
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sqRingSize = cqRingSize = qMax(sqRingSize, cqRingSize);
+
+  sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ringFd, IORING_OFF_SQ_RING);
+  if (sqRing == MAP_FAILED)
+    return false;
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    cqRing = sqRing;
+  else {
+    cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  ringFd, IORING_OFF_CQ_RING);
+    if (cqRing == MAP_FAILED)
+      return false;
+  }
+
+  sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	      ringFd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    return false;
+
+  char *sq = (char *)sqRing;
+  sqHead = (unsigned *)(sq + params.sq_off.head);
+  sqTail = (unsigned *)(sq + params.sq_off.tail);
+  sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  sqEntries = *(unsigned *)(sq + params.sq_off.ring_entries);
+  sqArray = (unsigned *)(sq + params.sq_off.array);
+
+  char *cq = (char *)cqRing;
+  cqHead = (unsigned *)(cq + params.cq_off.head);
+  cqTail = (unsigned *)(cq + params.cq_off.tail);
+  cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  cqes = cq + params.cq_off.cqes;
+  return true;
+#else
+  Q_UNUSED(entries);
+  return false;
+#endif
+}
+
+// Ask the kernel whether it knows an opcode.
+bool
+IoRing::Supports(int opcode)
+{
+#ifdef HAVE_IO_URING
+  const unsigned ops = 256;
+  QByteArray buffer(sizeof(struct io_uring_probe) + ops * sizeof(struct io_uring_probe_op), 0);
+  struct io_uring_probe *probe = (struct io_uring_probe *)buffer.data();
+
+  if (io_uring_register(ringFd, IORING_REGISTER_PROBE, probe, ops) < 0)
+    return false;
+  return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+#else
+  Q_UNUSED(opcode);
+  return false;
+#endif
+}
+
+bool
+IoRing::IsOpen() const
+{
+  return ringFd >= 0 && sqes != MAP_FAILED;
+}
+
+bool
+IoRing::RegisterEventFd(int eventFd)
+{
+#ifdef HAVE_IO_URING
+  return io_uring_register(ringFd, IORING_REGISTER_EVENTFD, &eventFd, 1) == 0;
+#else
+  Q_UNUSED(eventFd);
+  return false;
+#endif
+}
+
+bool
+IoRing::PrepareRead(int fd, char *buffer, unsigned length, qint64 offset, quint64 tag)
+{
+#ifdef HAVE_IO_URING
+  return Prepare(IORING_OP_READ, fd, buffer, length, offset, tag);
+#else
+  return false;
+#endif
+}
+
+bool
+IoRing::PrepareWrite(int fd, const char *buffer, unsigned length, qint64 offset, quint64 tag)
+{
+#ifdef HAVE_IO_URING
+  return Prepare(IORING_OP_WRITE, fd, buffer, length, offset, tag);
+#else
+  return false;
+#endif
+}
+
+bool
+IoRing::Prepare(int opcode, int fd, const char *buffer, unsigned length, qint64 offset, quint64 tag)
+{
+#ifdef HAVE_IO_URING
+  unsigned tail = *sqTail;
+  unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+  if (tail - head >= sqEntries)
+    return false;
+
+  unsigned index = tail & sqMask;
+  struct io_uring_sqe *sqe = (struct io_uring_sqe *)sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)buffer;
+  sqe->len = length;
+  sqe->off = offset;
+  sqe->user_data = tag;
+
+  sqArray[index] = index;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+  ++pending;
+  return true;
+#else
+  Q_UNUSED(opcode); Q_UNUSED(fd); Q_UNUSED(buffer);
+  Q_UNUSED(length); Q_UNUSED(offset); Q_UNUSED(tag);
+  return false;
+#endif
+}
+
+int
+IoRing::Submit(unsigned waitFor)
+{
+#ifdef HAVE_IO_URING
+  int submitted = io_uring_enter(ringFd, pending, waitFor,
+				 waitFor ? IORING_ENTER_GETEVENTS : 0);
+  if (submitted > 0)
+    pending -= submitted;
+  return submitted;
+#else
+  Q_UNUSED(waitFor);
+  return -ENOSYS;
+#endif
+}
+
+bool
+IoRing::Reap(quint64 *tag, int *result)
+{
+#ifdef HAVE_IO_URING
+  unsigned head = *cqHead;
+  if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+    return false;
+
+  struct io_uring_cqe *cqe = (struct io_uring_cqe *)cqes + (head & cqMask);
+  *tag = cqe->user_data;
+  *result = cqe->res;
+  __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+  return true;
+#else
+  Q_UNUSED(tag); Q_UNUSED(result);
+  return false;
+#endif
+}
+
+
+
+DiskTask::DiskTask(DiskIO *io, quint64 id, int fd, qint64 offset, const QByteArray& buffer, DiskOp op)
+{
+  m_io = io;
+  m_id = id;
+  m_fd = fd;
+  m_offset = offset;
+  m_buffer = buffer;
+  m_op = op;
+}
+
+void
+DiskTask::run()
+{
+  qint64 result;
+  if (m_op == DiskWrite)
+    result = ::pwrite(m_fd, m_buffer.constData(), m_buffer.size(), m_offset);
+  else
+    result = ::fdatasync(m_fd);
+
+  if (result < 0)
+    result = -errno;
+
+  QMetaObject::invokeMethod(m_io, "Complete", Qt::QueuedConnection,
+			    Q_ARG(quint64, m_id), Q_ARG(qint64, result));
+}
+
+
+
+DiskIO::DiskIO()
+{
+  qRegisterMetaType<quint64>("quint64");
+  qRegisterMetaType<qint64>("qint64");
+
+  nextId = 1;
+  inflight = 0;
+  submitQueued = false;
+  eventFd = -1;
+  notifier = NULL;
+  workers.setMaxThreadCount(DISK_THREADS);
+
+  // Completions wake the event loop through an eventfd.
+  if (ring.Open(DISK_QUEUE_DEPTH)){
+
+    eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd >= 0 && ring.RegisterEventFd(eventFd)){
+
+      notifier = new QSocketNotifier(eventFd, QSocketNotifier::Read, this);
+      connect(notifier, SIGNAL(activated(int)),
+	      this, SLOT(ReapRing()));
+    }
+  }
+  qDebug() << "Disk I/O: using " << Backend();
+}
+
+DiskIO::~DiskIO()
+{
+  workers.waitForDone();
+
+  // Let the kernel finish with the buffers before they go away.
+  while (notifier != NULL && inflight > 0){
+
+    ring.Submit(1);
+    quint64 tag;
+    int result;
+    while (ring.Reap(&tag, &result))
+      --inflight;
+  }
+
+  if (eventFd >= 0)
+    ::close(eventFd);
+}
+
+const char *
+DiskIO::Backend()
+{
+  return notifier != NULL ? "io_uring" : "thread pool";
+}
+
+quint64
+DiskIO::Write(int fd, qint64 offset, const QByteArray& data)
+{
+  Request request;
+  request.fd = fd;
+  request.offset = offset;
+  request.buffer = data;
+  request.op = DiskWrite;
+
+  quint64 id = nextId++;
+  requests[id] = request;
+  Start(id);
+  return id;
+}
+
+// Flush what was written to fd so far, result is 0 or -errno.
+quint64
+DiskIO::Sync(int fd)
+{
+  Request request;
+  request.fd = fd;
+  request.offset = 0;
+  request.op = DiskSync;
+
+  quint64 id = nextId++;
+  requests[id] = request;
+  Start(id);
+  return id;
+}
+
+// Queue the request, or keep it back while the ring is full.
+void
+DiskIO::Start(quint64 id)
+{
+  Request& request = requests[id];
+
+  if (request.fd < 0){
+    QMetaObject::invokeMethod(this, "Complete", Qt::QueuedConnection,
+			      Q_ARG(quint64, id), Q_ARG(qint64, -EBADF));
+    return;
+  }
+
+  if (notifier == NULL || request.op == DiskSync){
+    workers.start(new DiskTask(this, id, request.fd, request.offset, request.buffer, request.op));
+    return;
+  }
+
+  if (inflight >= DISK_QUEUE_DEPTH){
+    backlog.append(id);
+    return;
+  }
+
+  if (!ring.PrepareWrite(request.fd, request.buffer.constData(), request.buffer.size(), request.offset, id)){
+    backlog.append(id);
+    return;
+  }
+
+  // Everything prepared on this pass goes to the kernel at once.
+  ++inflight;
+  if (!submitQueued){
+    submitQueued = true;
+    QMetaObject::invokeMethod(this, "Submit", Qt::QueuedConnection);
+  }
+}
+
+void
+DiskIO::Submit()
+{
+  submitQueued = false;
+  ring.Submit(0);
+}
+
+void
+DiskIO::ReapRing()
+{
+  quint64 count;
+  if (::read(eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    qDebug() << "Disk I/O: couldn't read the eventfd";
+
+  quint64 tag;
+  int result;
+  while (ring.Reap(&tag, &result)){
+
+    --inflight;
+    Complete(tag, result);
+  }
+
+  // Start what was held back, each at most once: Start() puts it
+  // back if the ring is still full.
+  int waiting = backlog.count();
+  while (waiting-- > 0 && inflight < DISK_QUEUE_DEPTH)
+    Start(backlog.takeFirst());
+}
+
+void
+DiskIO::Complete(quint64 id, qint64 result)
+{
+  if (requests.remove(id) == 0)
+    return;
+
+  emit completed(id, result);
+}
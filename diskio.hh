@@ -0,0 +1,182 @@
+#ifndef DISKIO_HH
+#define DISKIO_HH
+
+#include <QObject>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QSocketNotifier>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+
+#define DISK_QUEUE_DEPTH 128   // Most writes we keep in flight
+#define DISK_THREADS 8         // Threads doing blocking I/O when there is no io_uring
+
+/*
+ * A bare io_uring, set up with raw system calls so we don't need
+ * liburing. Not thread safe: each ring is used by one thread.
+ * Open() fails where the kernel (or the build, without
+ * HAVE_IO_URING) doesn't have io_uring, or has it without READ and
+ * WRITE, callers then do plain blocking I/O instead.
+ */
+class IoRing
+{
+public:
+  IoRing();
+  ~IoRing();
+
+  bool
+  Open(unsigned entries);
+
+  bool
+  IsOpen() const;
+
+  // Signal this eventfd whenever a completion is posted.
+  bool
+  RegisterEventFd(int eventFd);
+
+  // Queue an operation, false when the submission queue is full.
+  bool
+  PrepareRead(int fd, char *buffer, unsigned length, qint64 offset, quint64 tag);
+
+  bool
+  PrepareWrite(int fd, const char *buffer, unsigned length, qint64 offset, quint64 tag);
+
+  // Hand the queued operations to the kernel, and wait until at
+  // least waitFor of them have completed.
+  int
+  Submit(unsigned waitFor);
+
+  // Take the next completion, false when there is none.
+  bool
+  Reap(quint64 *tag, int *result);
+
+private:
+
+  bool
+  Supports(int opcode);
+
+  bool
+  Prepare(int opcode, int fd, const char *buffer, unsigned length, qint64 offset, quint64 tag);
+
+  int ringFd;
+  unsigned pending;
+
+  void *sqRing;
+  void *cqRing;
+  void *sqes;
+  size_t sqRingSize;
+  size_t cqRingSize;
+  size_t sqesSize;
+
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned sqMask;
+  unsigned sqEntries;
+  unsigned *sqArray;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  void *cqes;
+};
+
+class DiskIO;
+
+enum DiskOp
+{
+  DiskWrite,
+  DiskSync
+};
+
+// One blocking write or sync on the DiskIO thread pool.
+class DiskTask : public QRunnable
+{
+public:
+  DiskTask(DiskIO *io, quint64 id, int fd, qint64 offset, const QByteArray& buffer, DiskOp op);
+
+  void
+  run();
+
+private:
+  DiskIO *m_io;
+  quint64 m_id;
+  int m_fd;
+  qint64 m_offset;
+  QByteArray m_buffer;
+  DiskOp m_op;
+};
+
+/*
+ * Asynchronous positional writes and syncs, completed on the event
+ * loop. With io_uring up to DISK_QUEUE_DEPTH writes are in the
+ * kernel at once, handed over once per pass of the event loop, and
+ * an eventfd tells the event loop when some are done. Without it,
+ * DISK_THREADS threads do blocking pwrite. Syncs (fdatasync) always
+ * go to the threads. Reads stay with their callers: the indexer
+ * has rings of its own and BlockServer's threads read directly.
+ *
+ * The descriptor is used as it is, not duplicated: callers keep it
+ * open until the request has completed.
+ */
+class DiskIO : public QObject
+{
+  Q_OBJECT
+
+public:
+  DiskIO();
+  ~DiskIO();
+
+  quint64
+  Write(int fd, qint64 offset, const QByteArray& data);
+
+  quint64
+  Sync(int fd);
+
+  const char *
+  Backend();
+
+signals:
+
+  // result is the byte count (0 for a sync) or -errno.
+  void
+  completed(quint64 id, qint64 result);
+
+public slots:
+
+  void
+  Complete(quint64 id, qint64 result);
+
+private slots:
+
+  void
+  ReapRing();
+
+  void
+  Submit();
+
+private:
+
+  struct Request
+  {
+    int fd;
+    qint64 offset;
+    QByteArray buffer;
+    DiskOp op;
+  };
+
+  void
+  Start(quint64 id);
+
+  IoRing ring;
+  int eventFd;
+  QSocketNotifier *notifier;
+  QThreadPool workers;
+
+  quint64 nextId;
+  int inflight;
+  bool submitQueued;        // Submit() is due on this pass of the event loop
+  QHash<quint64, Request> requests;
+  QList<quint64> backlog;
+};
+
+#endif // DISKIO_HH
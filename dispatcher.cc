@@ -1,11 +1,26 @@
 #include <dispatcher.hh>
 #include <main.hh>
+#include <router.hh>
 
 
 Dispatcher::Dispatcher(FileStore *fs, NetSocket *netsocket)
+  : server(fs)
 {
   m_fs = fs;
   m_netsocket = netsocket;
+
+  servedBlocks = servedBytes = serveTime = serveFailures = 0;
+  connect(&server, SIGNAL(served(const QString&, qint64, qint64)),
+	  this, SLOT(blockServed(const QString&, qint64, qint64)));
+
+  connect(&seenTimer, SIGNAL(timeout()),
+	  this, SLOT(expireSearches()));
+  seenTimer.start(SEEN_SEARCH_TTL / 2);
+
+  clock.start();
+  queuedBlocks = 0;
+  connect(&serveTimer, SIGNAL(timeout()),
+	  this, SLOT(serveBlocks()));
 }
 
 void
@@ -14,66 +29,540 @@ Dispatcher::processRequest(const QMap<QString, QVariant> &request)
 
   //QUuid requestId = QUuid::createUuid();
   //pendingRequests[requestId] = request;
-  QMap<QString, QVariant> ret;
   
   if (isBlockRequest(request)){
     
-    QByteArray retBlock;
-    QByteArray retIndex;
-    QByteArray index = request["BlockRequest"].toByteArray();
+    QString origin = request["Origin"].toString();
+
+    // One hash, a list of them, or a range of a hash list.
+    QList<QByteArray> indexes;
+    if (request.contains("BlockRequest"))
+      indexes.append(request["BlockRequest"].toByteArray());
 
-    if (m_fs->ReturnBlock(index, &retBlock, &retIndex)){
-      
-      qDebug() << "Dispatcher:Got block request from found!";
-      ret["BlockReply"] = retIndex;
-      ret["Data"] = retBlock;
+    else if (request.contains("BlockList")){
 
-      emit reply(ret, request["Origin"].toString());
+      QList<QVariant> list = request["BlockList"].toList();
+      for(int i = 0; i < list.count() && i < RANGE_COUNT; ++i)
+	indexes.append(list[i].toByteArray());
     }
-    else {
-      qDebug() << "Dispatcher: Couldn't find block!";
+    else if (!m_fs->ListEntries(request["BlockRange"].toByteArray(), request["Start"].toInt(),
+				qMin(request["Count"].toInt(), RANGE_COUNT), &indexes)){
+      qDebug() << "Dispatcher: Couldn't find hash list!";
+    }
+
+    // Once one is turned away the requester backs off, the rest
+    // would be too.
+    for(int i = 0; i < indexes.count(); ++i){
+
+      if (!queueBlock(indexes[i], origin))
+	break;
     }
-    
   }
   else if (isSearchRequest(request)){
-    
-    quint32 budget = request["Budget"].toUInt();
-    
-    if (budget > 0){
-      
-      qDebug() << "Dispatcher:Got search request";
-      if(m_fs->Search(request["Search"].toString(), &ret)){
-	qDebug() << ret;
-	qDebug() << "Dispatcher:Found match!";
-	emit reply(ret, request["Origin"].toString());
-      }      
-      
-      distributeBudget(budget-1, request);
-    }     
+    processSearch(request, QHostAddress(), 0);
+  }
+}
+
+void
+Dispatcher::processSearch(const QMap<QString, QVariant> &request, const QHostAddress& sender, quint16 senderPort)
+{
+  QMap<QString, QVariant> ret;
+  QString upstream = neighborKey(sender, senderPort);
+
+  if (!isSearchRequest(request))
+    return;
+
+  quint32 budget = request["Budget"].toUInt();
+  QString key = searchKey(request);
+
+  if (seenSearches.contains(key)){
+
+    // We already searched and answered, only pass on the budget
+    // this round added. Each upstream neighbor sends its own
+    // running total, the increases of all of them add up.
+    SeenSearch& seen = seenSearches[key];
+    seen.seen = QDateTime::currentDateTime();
+    quint32 before = seen.received.value(upstream);
+    if (budget <= before)
+      return;
+
+    seen.received[upstream] = budget;
+    distributeBudget(budget - before, request, upstream, &seen);
+    return;
+  }
+
+  if (budget == 0)
+    return;
+
+  // Only searches we run cost a token. Over the rate the search is
+  // dropped, and not remembered: the next round of it comes with
+  // more budget anyway.
+  int retryAfter;
+  if (!admit("Search/" + request["Origin"].toString(), SEARCH_RATE, SEARCH_BURST, &retryAfter)){
+    qDebug() << "Dispatcher: " << request["Origin"].toString() << " is over its search rate";
+    return;
+  }
+
+  SeenSearch& seen = seenSearches[key];
+  seen.received[upstream] = budget;
+  seen.seen = QDateTime::currentDateTime();
+
+  qDebug() << "Dispatcher:Got search request";
+  if(m_fs->Search(request["Search"].toString(), NUM_MATCHES, &ret)){
+    if (request.contains("SearchID"))
+      ret["SearchID"] = request["SearchID"];
+    qDebug() << ret;
+    qDebug() << "Dispatcher:Found match!";
+    emit reply(ret, request["Origin"].toString());
+  }
+
+  // Each match we already know of saves budget further out.
+  quint32 cached = answerFromCache(request);
+  distributeBudget(budget - 1 - qMin(cached, budget - 1), request, upstream, &seen);
+}
+
+/*
+ * A search reply on its way back. It is matched to the search by
+ * its SearchID, and credited to the neighbors we sent that search
+ * to. Replies take the shortest route back, not always the way the
+ * search went: when it didn't come through one of them, each gets a
+ * share of the credit by the budget it was given, and the latency
+ * is left alone.
+ */
+void
+Dispatcher::creditNeighbor(const QMap<QString, QVariant> &reply, const QHostAddress& sender, quint16 senderPort)
+{
+  if (!reply.contains("SearchID") || reply["MatchIDs"].toList().isEmpty())
+    return;
+
+  QString key = reply["Dest"].toString() + "/" + reply["SearchID"].toString();
+  if (!seenSearches.contains(key))
+    return;
+
+  const SeenSearch& seen = seenSearches[key];
+  QString from = neighborKey(sender, senderPort);
+
+  if (seen.sent.contains(from)){
+
+    NeighborYield& yield = yields[from];
+    double latency = clock.elapsed() - seen.sentAt.value(from);
+    yield.hits += 1;
+    yield.latency = yield.latency == 0 ? latency :
+      LATENCY_KEEP * yield.latency + (1 - LATENCY_KEEP) * latency;
+    return;
+  }
+
+  quint32 total = 0;
+  QHash<QString, quint32>::const_iterator it = seen.sent.constBegin();
+  for(; it != seen.sent.constEnd(); ++it)
+    total += it.value();
+
+  for(it = seen.sent.constBegin(); it != seen.sent.constEnd(); ++it)
+    yields[it.key()].hits += (double)it.value() / total;
+}
+
+QString
+Dispatcher::neighborKey(const QHostAddress& address, quint16 port)
+{
+  return address.toString() + ":" + QString::number(port);
+}
+
+// Requests from nodes without search ids are told apart by query.
+QString
+Dispatcher::searchKey(const QMap<QString, QVariant> &request)
+{
+  if (request.contains("SearchID"))
+    return request["Origin"].toString() + "/" + request["SearchID"].toString();
+  return request["Origin"].toString() + "//" + request["Search"].toString();
+}
+
+void
+Dispatcher::expireSearches()
+{
+  if (servedBlocks > 0 || serveFailures > 0){
+
+    qDebug() << "Dispatcher: served " << servedBlocks << " blocks, " << servedBytes << " bytes, "
+	     << (servedBlocks > 0 ? serveTime / servedBlocks : 0) << " ms each, "
+	     << serveFailures << " failed";
+    servedBlocks = servedBytes = serveTime = serveFailures = 0;
+  }
+
+  // Older statistics count for less and less.
+  QHash<QString, NeighborYield>::iterator y = yields.begin();
+  while (y != yields.end()){
+
+    y.value().sent *= YIELD_DECAY;
+    y.value().hits *= YIELD_DECAY;
+    if (y.value().sent < 0.01 && y.value().hits < 0.01)
+      y = yields.erase(y);
+    else
+      ++y;
+  }
+
+  // Buckets that have been full for a while are the same as new.
+  QHash<QString, TokenBucket>::iterator b = buckets.begin();
+  while (b != buckets.end()){
+
+    if (clock.elapsed() - b.value().last > SEEN_SEARCH_TTL)
+      b = buckets.erase(b);
+    else
+      ++b;
+  }
+
+  QDateTime stale = QDateTime::currentDateTime().addMSecs(-SEARCH_CACHE_TTL);
+
+  QHash<QString, CachedSearch>::iterator c = searchCache.begin();
+  while (c != searchCache.end()){
+
+    QList<CachedMatch>& matches = c.value().matches;
+    while (!matches.isEmpty() && matches.first().seen < stale)
+      matches.removeFirst();
+
+    if (matches.isEmpty())
+      c = searchCache.erase(c);
+    else
+      ++c;
+  }
+
+  QDateTime oldest = QDateTime::currentDateTime().addMSecs(-SEEN_SEARCH_TTL);
+
+  QHash<QString, SeenSearch>::iterator it = seenSearches.begin();
+  while (it != seenSearches.end()){
+
+    if (it.value().seen < oldest)
+      it = seenSearches.erase(it);
+    else
+      ++it;
+  }
+}
+
+// Queue a block for serving, or tell the origin we're busy.
+bool
+Dispatcher::queueBlock(const QByteArray& index, const QString& origin)
+{
+  // Asked again before we got to it.
+  ServeQueue& queue = serveQueues[origin];
+  if (queue.queued.contains(index))
+    return true;
+
+  int retryAfter;
+  bool queued = false;
+  if (!admit("Block/" + origin, BLOCK_RATE, BLOCK_BURST, &retryAfter)){
+    qDebug() << "Dispatcher: " << origin << " is over its block rate";
+    sendBusy(index, origin, retryAfter);
+  }
+  else if (queuedBlocks >= SERVE_QUEUE || queue.blocks.count() >= SERVE_QUEUE_ORIGIN){
+    qDebug() << "Dispatcher: serve queue full, turning away " << origin;
+    sendBusy(index, origin, qMax(1, queuedBlocks / SERVE_BATCH) * SERVE_INTERVAL);
+  }
+  else {
+    if (queue.blocks.isEmpty())
+      serveOrder.append(origin);
+    queue.blocks.append(index);
+    queue.queued.insert(index);
+    ++queuedBlocks;
+    queued = true;
+
+    if (!serveTimer.isActive())
+      serveTimer.start(0);
+  }
+
+  if (queue.blocks.isEmpty())
+    serveQueues.remove(origin);
+  return queued;
+}
+
+/*
+ * Take a token from the bucket, refilled at rate per second up to
+ * burst. Without one, retryAfter is how long (ms) until there is.
+ */
+bool
+Dispatcher::admit(const QString& key, double rate, double burst, int *retryAfter)
+{
+  qint64 now = clock.elapsed();
+
+  QHash<QString, TokenBucket>::iterator it = buckets.find(key);
+  if (it == buckets.end()){
+
+    TokenBucket bucket;
+    bucket.tokens = burst;
+    bucket.last = now;
+    it = buckets.insert(key, bucket);
+  }
+
+  TokenBucket& bucket = it.value();
+  bucket.tokens = qMin(burst, bucket.tokens + (now - bucket.last) * rate / 1000);
+  bucket.last = now;
+
+  if (bucket.tokens >= 1){
+    bucket.tokens -= 1;
+    return true;
+  }
+
+  *retryAfter = (int)((1 - bucket.tokens) * 1000 / rate) + 1;
+  return false;
+}
+
+void
+Dispatcher::sendBusy(const QByteArray& index, const QString& dest, int retryAfter)
+{
+  QMap<QString, QVariant> ret;
+  ret["BlockBusy"] = index;
+  ret["RetryAfter"] = retryAfter;
+  emit reply(ret, dest);
+}
+
+/*
+ * One serving round: deficit round robin over the origins with
+ * requests waiting. Each turn an origin gets SERVE_QUANTUM more
+ * requests it may start, what it doesn't use it keeps while it has
+ * requests queued. At most SERVE_BATCH jobs go to the block server
+ * per round, and no more than SERVE_INFLIGHT are ever in its hands.
+ */
+void
+Dispatcher::serveBlocks()
+{
+  int started = 0;
+  int turns = serveOrder.count();
+
+  ServeJob job;
+  job.origin = m_netsocket->router->me;
+  job.socket = m_netsocket->socketDescriptor();
+
+  while (started < SERVE_BATCH && server.Pending() < SERVE_INFLIGHT && turns-- > 0){
+
+    QString origin = serveOrder.takeFirst();
+    ServeQueue& queue = serveQueues[origin];
+    queue.deficit += SERVE_QUANTUM;
+
+    bool routed = m_netsocket->router->route(origin, &job.address, &job.port);
+    job.dest = origin;
+
+    while (queue.deficit > 0 && !queue.blocks.isEmpty() &&
+	   started < SERVE_BATCH && server.Pending() < SERVE_INFLIGHT){
+
+      job.index = queue.blocks.takeFirst();
+      queue.queued.remove(job.index);
+      --queuedBlocks;
+      --queue.deficit;
+      ++started;
+
+      if (routed)
+	server.Serve(job);
+      else
+	qDebug() << "Dispatcher: no route to " << origin;
+    }
+
+    if (queue.blocks.isEmpty())
+      serveQueues.remove(origin);
+    else
+      serveOrder.append(origin);
+  }
+
+  if (serveOrder.isEmpty())
+    serveTimer.stop();
+  else
+    serveTimer.start(SERVE_INTERVAL);
+}
+
+/*
+ * Remember the matches of a search reply going by. Replies that
+ * came from a cache aren't cached again, their matches would never
+ * age out. Each query keeps its NUM_MATCHES freshest matches.
+ */
+void
+Dispatcher::cacheSearchReply(const QMap<QString, QVariant> &msg)
+{
+  if (msg.contains("Cached"))
+    return;
+
+  QString query = msg["SearchReply"].toString();
+  QString holder = msg["Origin"].toString();
+  QList<QVariant> names = msg["MatchNames"].toList();
+  QList<QVariant> ids = msg["MatchIDs"].toList();
+  QDateTime now = QDateTime::currentDateTime();
+
+  if (!searchCache.contains(query) && searchCache.count() >= SEARCH_CACHE_SIZE){
+
+    // Make room by dropping the query that was updated longest ago.
+    QHash<QString, CachedSearch>::iterator oldest = searchCache.begin();
+    QHash<QString, CachedSearch>::iterator it = searchCache.begin();
+    for(; it != searchCache.end(); ++it){
+
+      if (it.value().updated < oldest.value().updated)
+	oldest = it;
+    }
+    searchCache.erase(oldest);
+  }
+
+  CachedSearch& search = searchCache[query];
+  search.updated = now;
+
+  for(int i = 0; i < names.count() && i < ids.count(); ++i){
+
+    CachedMatch match;
+    match.holder = holder;
+    match.name = names[i].toString();
+    match.id = ids[i].toByteArray();
+    match.seen = now;
+
+    for(int j = 0; j < search.matches.count(); ++j){
+
+      if (search.matches[j].holder == holder && search.matches[j].id == match.id){
+	search.matches.removeAt(j);
+	break;
+      }
+    }
+    search.matches.append(match);
+  }
+
+  while (search.matches.count() > NUM_MATCHES)
+    search.matches.removeFirst();
+}
+
+/*
+ * Send the searcher what we remember for its query, in one reply
+ * marked Cached. The origin of a cached reply is us, so each match
+ * names the node holding the file. Returns the number of matches.
+ */
+int
+Dispatcher::answerFromCache(const QMap<QString, QVariant> &request)
+{
+  QString query = request["Search"].toString();
+  QString searcher = request["Origin"].toString();
+  if (!searchCache.contains(query))
+    return 0;
+
+  QDateTime oldest = QDateTime::currentDateTime().addMSecs(-SEARCH_CACHE_TTL);
+  const QList<CachedMatch>& matches = searchCache[query].matches;
+
+  QList<QVariant> names;
+  QList<QVariant> ids;
+  QList<QVariant> holders;
+  for(int i = 0; i < matches.count(); ++i){
+
+    if (matches[i].seen < oldest || matches[i].holder == searcher)
+      continue;
+
+    names.append(matches[i].name);
+    ids.append(matches[i].id);
+    holders.append(matches[i].holder);
+  }
+
+  if (ids.isEmpty())
+    return 0;
+
+  QMap<QString, QVariant> ret;
+  ret["SearchReply"] = query;
+  ret["MatchNames"] = names;
+  ret["MatchIDs"] = ids;
+  ret["Holders"] = holders;
+  ret["Cached"] = true;
+  if (request.contains("SearchID"))
+    ret["SearchID"] = request["SearchID"];
+  qDebug() << "Dispatcher: answering " << query << " from the cache";
+  emit reply(ret, searcher);
+  return ids.count();
+}
+
+void
+Dispatcher::blockServed(const QString& dest, qint64 bytes, qint64 msecs)
+{
+  Q_UNUSED(dest);
+  if (bytes < 0){
+    ++serveFailures;
+    return;
   }
+
+  ++servedBlocks;
+  servedBytes += bytes;
+  serveTime += msecs;
 }
 
+/*
+ * Split b more budget between the neighbors, leaving out the one
+ * the search came from. Shares follow each neighbor's recent yield,
+ * replies per unit of budget (smoothed, so new neighbors get their
+ * chance). Neighbors with no share are sent nothing.
+ *
+ * A neighbor is sent its running total for this search, so it sees
+ * its budget grow by exactly its share and passes on only that much.
+ */
 void
-Dispatcher::distributeBudget(quint32 b, const QMap<QString, QVariant> &request)
+Dispatcher::distributeBudget(quint32 b, const QMap<QString, QVariant> &request,
+			     const QString& upstream, SeenSearch *seen)
 {
+  QList<QPair<QHostAddress, quint16> > neighbors = m_netsocket->neighbors();
+
+  QList<int> targets;
+  QList<QString> keys;
+  QList<double> weights;
+  double total = 0;
+
+  for(int i = 0; i < neighbors.count(); ++i){
+
+    QString key = neighborKey(neighbors[i].first, neighbors[i].second);
+    if (key == upstream)
+      continue;
+
+    // Slow neighbors get less, their replies may come after the
+    // searcher has moved on.
+    const NeighborYield& yield = yields.value(key);
+    double weight = (yield.hits + 1) / (yield.sent + 2) / (1 + yield.latency / SEARCH_LATENCY);
+
+    targets.append(i);
+    keys.append(key);
+    weights.append(weight);
+    total += weight;
+  }
+
+  int count = targets.count();
+  if (count == 0 || b == 0)
+    return;
+
+  // Largest remainder, ties going to a random neighbor.
   QList<quint32> budgets;
+  QList<double> remainders;
+  quint32 given = 0;
+  for(int i = 0; i < count; ++i){
 
-  quint32 numNeighbors = m_netsocket->numNeighbors();
+    double exact = b * weights[i] / total;
+    budgets.append((quint32)exact);
+    remainders.append(exact - budgets[i]);
+    given += budgets[i];
+  }
 
-  for(int i = 0; i < numNeighbors; ++i)
-    budgets.append(0);
-  
-  for(int i = 0; b > 0;--b, ++i)    
-    budgets[i%numNeighbors] += 1;
-  
+  int start = qrand() % count;
+  for(; given < b; ++given){
+
+    int best = start;
+    for(int j = 0; j < count; ++j){
+
+      int i = (start + j) % count;
+      if (remainders[i] > remainders[best])
+	best = i;
+    }
+    budgets[best] += 1;
+    remainders[best] = -1;
+    start = (start + 1) % count;
+  }
   
-  for(int i = 0; i < numNeighbors; ++i){
+  for(int i = 0; i < count; ++i){
+
+    if (budgets[i] == 0)
+      continue;
+
+    seen->sent[keys[i]] += budgets[i];
+    seen->sentAt[keys[i]] = clock.elapsed();
+    yields[keys[i]].sent += budgets[i];
     
     QMap<QString, QVariant> toSend;
     toSend["Origin"] = request["Origin"].toString();
     toSend["Search"] = request["Search"].toString();
-    toSend["Budget"] = budgets[i];
-    emit sendNeighbor(toSend, i);
+    toSend["Budget"] = seen->sent[keys[i]];
+    if (request.contains("SearchID"))
+      toSend["SearchID"] = request["SearchID"];
+    emit sendNeighbor(toSend, targets[i]);
   }    
 }
 
@@ -84,7 +573,9 @@ Dispatcher::isBlockRequest(const QMap<QString, QVariant> &request)
     request.contains("Dest") &&
     request.contains("Origin") &&
     request.contains("HopLimit") &&
-    request.contains("BlockRequest");
+    (request.contains("BlockRequest") ||
+     request.contains("BlockList") ||
+     (request.contains("BlockRange") && request.contains("Start") && request.contains("Count")));
 }
 
 bool 
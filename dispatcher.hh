@@ -7,11 +7,74 @@
 #include <QVariant>
 #include <QMap>
 #include <QString>
+#include <QTimer>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QList>
+#include <QSet>
 
 #include <files.hh>
+#include <blockserver.hh>
 
 class NetSocket;
 
+// A search we already handled: the budget each upstream neighbor
+// has given it so far, and how much of it we passed to each
+// neighbor.
+struct SeenSearch
+{
+  QHash<QString, quint32> received;
+  QDateTime seen;
+  QHash<QString, quint32> sent;
+  QHash<QString, qint64> sentAt;  // When each was last sent more
+};
+
+// How well searches sent through a neighbor paid off lately: the
+// budget we gave it, the replies its searches brought back, and
+// how long they took.
+struct NeighborYield
+{
+  NeighborYield() : sent(0), hits(0), latency(0) {}
+
+  double sent;
+  double hits;
+  double latency;
+};
+
+// A match from a search reply that passed through us.
+struct CachedMatch
+{
+  QString holder;
+  QString name;
+  QByteArray id;
+  QDateTime seen;
+};
+
+struct CachedSearch
+{
+  QList<CachedMatch> matches;
+  QDateTime updated;
+};
+
+// Requests an origin may still send: refilled at a steady rate
+// up to a burst, one token per request.
+struct TokenBucket
+{
+  double tokens;
+  qint64 last;
+};
+
+// Block requests from one origin waiting for their turn.
+struct ServeQueue
+{
+  ServeQueue() : deficit(0) {}
+
+  QList<QByteArray> blocks;
+  QSet<QByteArray> queued;
+  int deficit;
+};
+
 class Dispatcher : public QObject
 {
   Q_OBJECT
@@ -25,6 +88,24 @@ public slots:
   void
   processRequest(const QMap<QString, QVariant> &request);
 
+  void
+  processSearch(const QMap<QString, QVariant> &request, const QHostAddress& sender, quint16 senderPort);
+
+  void
+  creditNeighbor(const QMap<QString, QVariant> &reply, const QHostAddress& sender, quint16 senderPort);
+
+  void
+  blockServed(const QString& dest, qint64 bytes, qint64 msecs);
+
+  void
+  expireSearches();
+
+  void
+  cacheSearchReply(const QMap<QString, QVariant> &msg);
+
+  void
+  serveBlocks();
+
 
   /*
   void
@@ -42,9 +123,28 @@ private:
   //QHash<QUuid, QMap<QString, QVariant> > pendingRequests;
 
   void
-  distributeBudget(quint32 b, const QMap<QString, QVariant> &request);
+  distributeBudget(quint32 b, const QMap<QString, QVariant> &request,
+		   const QString& upstream, SeenSearch *seen);
+
+  static QString
+  neighborKey(const QHostAddress& address, quint16 port);
+
+  QString
+  searchKey(const QMap<QString, QVariant> &request);
 
   
+  int
+  answerFromCache(const QMap<QString, QVariant> &request);
+
+  bool
+  queueBlock(const QByteArray& index, const QString& origin);
+
+  bool
+  admit(const QString& key, double rate, double burst, int *retryAfter);
+
+  void
+  sendBusy(const QByteArray& index, const QString& dest, int retryAfter);
+
   bool
   isBlockRequest(const QMap<QString, QVariant> &request);
 
@@ -55,6 +155,38 @@ private:
   
   FileStore *m_fs;
   NetSocket *m_netsocket;
+
+  // Searches come back every round with a doubled budget, and
+  // through several neighbors. Each is handled once, repeats only
+  // pass on what they add to the total their neighbor sent.
+  QHash<QString, SeenSearch> seenSearches;
+  QTimer seenTimer;
+
+  QHash<QString, NeighborYield> yields;
+
+  // Recent search replies seen on their way back, by query, so
+  // repeats of popular searches are answered a hop or two out.
+  QHash<QString, CachedSearch> searchCache;
+
+  // Admission control. Each origin gets its own rate, block
+  // requests over it or past a full queue are told to come back
+  // later. Admitted ones are served a few at a time, deficit round
+  // robin between origins, so no single peer takes the disk.
+  QElapsedTimer clock;
+  QHash<QString, TokenBucket> buckets;
+  QHash<QString, ServeQueue> serveQueues;
+  QList<QString> serveOrder;
+  int queuedBlocks;
+  QTimer serveTimer;
+
+  // Blocks are read and sent on the block server's threads, at
+  // most SERVE_INFLIGHT at a time. What they report back is
+  // summed up here and logged every SEEN_SEARCH_TTL/2.
+  BlockServer server;
+  qint64 servedBlocks;
+  qint64 servedBytes;
+  qint64 serveTime;
+  qint64 serveFailures;
 };
 
 #endif // DISPATCHER_HH
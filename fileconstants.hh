@@ -4,8 +4,51 @@
 #define MAX_BUDGET 100      // The maximum budget we give a request
 #define START_BUDGET 2      // The budget we start with
 #define NUM_MATCHES 10      // Number of matches we wait for before stopping the request
+#define SEEN_SEARCH_TTL 60000  // How long (ms) we remember a search we handled
+#define YIELD_DECAY 0.5     // Weight neighbor search statistics keep every SEEN_SEARCH_TTL/2
+#define SEARCH_LATENCY 500  // Reply latency (ms) that halves a neighbor's share of search budget
+#define LATENCY_KEEP 0.75   // Weight a neighbor's smoothed reply latency keeps with each reply
+#define SEARCH_CACHE_TTL 300000  // How long (ms) we answer from a search reply that passed through
+#define SEARCH_CACHE_SIZE 1024   // Most queries we keep passing replies for
 #define BLOCK_SIZE 8192 
 #define HASH_SIZE 32
+#define INDEX_READERS 2     // Number of files we read and hash at the same time
+#define INDEX_BATCH 64      // Number of blocks handed to the hashing pool at once
+#define WORKER_OPEN_FILES 64  // Number of shared files each serving thread keeps open
+#define INDEX_MAGIC 0x50494458  // "PIDX", first word of the on-disk file index
+#define INDEX_VERSION 2
+#define CDC_MIN_SIZE 2048   // Content-defined chunking: smallest chunk we cut
+#define CDC_AVG_SIZE 8192   //   chunk size we aim for
+#define CDC_MAX_SIZE 16384  //   largest chunk we cut
+#define READAHEAD_RUN 2      // Sequential reads of a file before we start reading ahead
+#define READAHEAD_SIZE (512 * 1024)  // Bytes we ask the kernel to read ahead of a sequential reader
+#define READAHEAD_STREAMS 4  // Sequential readers of one file we keep track of
+#define REINDEX_DELAY 1000  // Quiet time (ms) after the last change before a file is rehashed
+#define BLOCK_RATE 400      // Block requests per second we take from one origin
+#define BLOCK_BURST 800     //   and how many it may send at once
+#define SEARCH_RATE 10      // Searches per second we take from one origin
+#define SEARCH_BURST 20     //   and how many it may send at once
+#define SERVE_QUEUE 1024    // Most block requests waiting to be served, all origins together
+#define SERVE_QUEUE_ORIGIN 256  // Most block requests waiting from one origin
+#define SERVE_INTERVAL 5    // Time (ms) between serving rounds
+#define SERVE_BATCH 32      // Block requests started each round
+#define SERVE_QUANTUM 4     // Block requests an origin may start each turn of a round
+#define RANGE_COUNT 32      // Most blocks one block request may name
+#define DOWNLOAD_TICK 50    // How often (ms) downloads look for blocks that timed out
+#define INITIAL_CWND 4      // Blocks a download may have outstanding at first
+#define MIN_CWND 2          //   at least
+#define MAX_CWND 256        //   and at most
+#define SOURCE_WINDOW 128   // Most blocks outstanding from one node, all downloads together
+#define INITIAL_RTO 1000    // Time (ms) before asking again, until we have a round trip sample
+#define MIN_RTO 200         // Shortest time (ms) before asking for a block again
+#define MAX_RTO 8000        // Longest, however often it timed out
+#define STALL_TIMEOUT 3000  // Time (ms) without a block before a source's requests go to the others
+#define ENDGAME_COPIES 2    // Sources asked at once for each of the last blocks of a download
+#define RATE_KEEP 0.9       // Weight a source's measured rate keeps every DOWNLOAD_TICK
+#define STATE_MAGIC 0x50445354  // "PDST", first word of a download's progress file
+#define STATE_VERSION 2
+#define STATE_BATCH 256     // Blocks written before a download's progress is saved
+#define STATE_INTERVAL 5000 // Longest time (ms) progress goes unsaved
 
 
 #endif // FILECONSTANTS_HH
@@ -1,21 +1,39 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
 #include <filerequests.hh>
+#include <sha256.hh>
 #include <QDir>
 #include <QFileInfo>
 #include <QFile>
-#include <QtCrypto>
+#include <QDirIterator>
+#include <QDataStream>
 #include <QDebug>
+#include <QtEndian>
+#include <QtAlgorithms>
 
 FileRequests::FileRequests(const QString& my_name)
 {
   me = my_name;
   timerDuration = 1000;
+
+  // Ids from an earlier run may still be remembered by our peers.
+  nextSearchId = qrand();
   timer.start(timerDuration);
-  downloadTimer.start(timerDuration);
+  downloadTimer.start(DOWNLOAD_TICK);
+  clock.start();
   QObject::connect(&timer, SIGNAL(timeout()),
   		   this, SLOT(processTimeout()));
   
    QObject::connect(&downloadTimer, SIGNAL(timeout()),
   		   this, SLOT(processDownloadTimeout()));
+
+   QObject::connect(&io, SIGNAL(completed(quint64, qint64)),
+		    this, SLOT(writeDone(quint64, qint64)));
+
+   resumeDownloads();
 }
 
 void
@@ -26,12 +44,16 @@ FileRequests::newDownload(const QString& fileName, const QString&destination, co
     
     QPair<QString, QString> val(fileName, destination);
     pendingDownloads[masterBlock] = val;
-    
-    QMap<QString, QVariant> req;
-    req["BlockRequest"] = masterBlock;
-    qDebug() << masterBlock;
-    qDebug() << masterBlock.size();
-    emit sendDownloadMsg(req, destination);
+
+    // Every node we know has the file is a source, the one
+    // picked in the UI first.
+    downloads[masterBlock] = DownloadState();
+    addSource(masterBlock, destination);
+    QList<QString> known = fileHolders.value(masterBlock).toList();
+    for(int i = 0; i < known.count(); ++i)
+      addSource(masterBlock, known[i]);
+
+    requestList(masterBlock, clock.elapsed());
   }
 }
 
@@ -51,26 +73,27 @@ FileRequests::processBlockReply(const QMap<QString, QVariant> & msg)
       
       qDebug() << "FileRequests: got the hash-list";
       if (!invertBlockHashes.contains(blockReply)){
-	QList<QByteArray> hashList;
-	int size = data.count();
-      
-	char *buf = data.data();
-	int count = 0;
-	for(int i = 0; i < size; i += HASH_SIZE){
-	
-	  QByteArray temp(&buf[i], HASH_SIZE);
-	
-	  hashList.append(temp);
-	  blockHashes[temp] = blockReply;
-	  
-	  QMap<QString, QVariant> msg;
-	  
-	  msg["BlockRequest"] = temp;
-	  emit sendDownloadMsg(msg, origin);
-	  ++count;
+
+	// A chunked file's lists have a 4-byte length after each hash.
+	// Nodes that don't send the level only have single-level files.
+	DownloadState& download = downloads[blockReply];
+	download.chunked = msg["Chunked"].toBool();
+	download.level = msg.contains("Level") ? msg["Level"].toInt() - 1 : 0;
+	parseList(blockReply, data, download.chunked);
+
+	if (download.level > 0){
+	  download.lists.resize(invertBlockHashes[blockReply].count());
+	  qDebug() << "Expect " << download.lists.count() << " lists";
 	}
-	qDebug() << "Expect " << count << " blocks";
-	invertBlockHashes[blockReply] = hashList;
+	else {
+	  qDebug() << "Expect " << invertBlockHashes[blockReply].count() << " blocks";
+	  if (!openFile(blockReply, download.chunked, false)){
+	    downloads.remove(blockReply);
+	    return;
+	  }
+	  saveState(blockReply);
+	}
+	scheduleBlocks(blockReply);
       }
     }
   
@@ -78,85 +101,774 @@ FileRequests::processBlockReply(const QMap<QString, QVariant> & msg)
     else if (blockHashes.contains(blockReply)){
       
       qDebug() << "FileRequests: got a data block!";
-      if (!pendingDownloadData.contains(blockReply)){
-	
-	pendingDownloadData[blockReply] = data;
-	QByteArray master = blockHashes[blockReply];
-	if(downloadCompleted(master)){
-	  
-	  qDebug() << "Download completed!";
-	  writeFile(master);
+      if (blockLengths.contains(blockReply) &&
+	  blockLengths[blockReply] != (quint32)data.size()){
+
+	qDebug() << "FileRequests: chunk has the wrong length, dropped";
+	return;
+      }
+
+      // Duplicates still count as delivered, they open the window.
+      QByteArray master = blockHashes[blockReply];
+      if (!downloads.contains(master))
+	return;
+
+      ackBlock(master, blockReply, origin);
+      storeBlock(master, blockReply, data);
+      scheduleBlocks(master);
+    }
+  }
+}
+
+void
+FileRequests::addSource(const QByteArray &master, const QString &origin)
+{
+  if (origin.isEmpty() || origin == me || downloads[master].sources.contains(origin))
+    return;
+
+  SourceState source;
+  source.lastProgress = clock.elapsed();
+  downloads[master].sources[origin] = source;
+  qDebug() << "FileRequests: " << origin << " is a source for " << master.toHex();
+}
+
+// Ask for the hash list, from the next source each time.
+void
+FileRequests::requestList(const QByteArray &master, qint64 now)
+{
+  DownloadState& download = downloads[master];
+  QList<QString> sources = download.sources.keys();
+  sources.removeAll(pendingDownloads[master].second);
+  sources.prepend(pendingDownloads[master].second);
+
+  for(int i = 0; i < sources.count(); ++i){
+
+    QString source = sources[(download.listTries + i) % sources.count()];
+    if (isBusy(source))
+      continue;
+
+    QMap<QString, QVariant> msg;
+    msg["BlockRequest"] = master;
+    emit sendDownloadMsg(msg, source);
+    break;
+  }
+  ++download.listTries;
+  download.listSent = now;
+}
+
+/*
+ * Hand out blocks to the download's sources, the fastest first.
+ * Every source is kept as busy as its window (and SOURCE_WINDOW)
+ * allows, so faster ones end up with a proportionally larger share
+ * of the file. Stalled and busy sources are skipped.
+ */
+void
+FileRequests::scheduleBlocks(const QByteArray &master)
+{
+  if (!downloads.contains(master) || !invertBlockHashes.contains(master))
+    return;
+
+  DownloadState& download = downloads[master];
+  qint64 now = clock.elapsed();
+
+  QList<QPair<double, QString> > order;
+  QHash<QString, SourceState>::const_iterator it = download.sources.constBegin();
+  for(; it != download.sources.constEnd(); ++it)
+    order.append(qMakePair(-it.value().rate, it.key()));
+  qSort(order);
+
+  for(int i = 0; i < order.count(); ++i){
+
+    const QString& name = order[i].second;
+    SourceState& source = download.sources[name];
+    if (isBusy(name) || now < source.stalledUntil)
+      continue;
+
+    int room = qMin((int)source.cwnd - source.sent.count(),
+		    SOURCE_WINDOW - sourceInFlight(name));
+    if (room > 0)
+      fillSource(master, name, room, now);
+  }
+}
+
+/*
+ * Ask one source for up to room blocks: those that timed out
+ * first, by hash, then new ones as ranges of the hash list. With
+ * nothing left to hand out, endgame: ask for blocks still
+ * outstanding elsewhere, up to ENDGAME_COPIES sources per block,
+ * so the last few don't wait on the slowest source. Returns the
+ * number asked for.
+ */
+int
+FileRequests::fillSource(const QByteArray &master, const QString &name, int room, qint64 now)
+{
+  DownloadState& download = downloads[master];
+  SourceState& source = download.sources[name];
+  const QList<QByteArray>& hashes = invertBlockHashes[master];
+  int asked = 0;
+
+  if (source.sent.isEmpty())
+    source.lastProgress = now;
+
+  QList<QVariant> list;
+  while (asked < room && !download.lost.isEmpty()){
+
+    int i = download.lost.takeFirst();
+    if (download.done.testBit(i))
+      continue;
+
+    source.sent[i] = now;
+    download.resent.insert(i);
+    list.append(hashes[i]);
+    ++asked;
+  }
+
+  while (asked < room && download.next < hashes.count()){
+
+    if (download.done.testBit(download.next)){
+      ++download.next;
+      continue;
+    }
+
+    // Deeper levels aren't the master's entries, so can't be
+    // asked for as ranges of it.
+    if (!download.ranged){
+      source.sent[download.next] = now;
+      list.append(hashes[download.next++]);
+      ++asked;
+      continue;
+    }
+
+    int n = 0;
+    for(; asked + n < room && n < RANGE_COUNT && download.next + n < hashes.count(); ++n)
+      source.sent[download.next + n] = now;
+
+    QMap<QString, QVariant> msg;
+    msg["BlockRange"] = master;
+    msg["Start"] = download.next;
+    msg["Count"] = n;
+    emit sendDownloadMsg(msg, name);
+
+    download.next += n;
+    asked += n;
+  }
+
+  if (asked < room && download.next == hashes.count() && download.lost.isEmpty()){
+
+    QHash<int, int> copies;
+    QHash<QString, SourceState>::const_iterator it = download.sources.constBegin();
+    for(; it != download.sources.constEnd(); ++it){
+
+      QList<int> outstanding = it.value().sent.keys();
+      for(int j = 0; j < outstanding.count(); ++j)
+	copies[outstanding[j]] += 1;
+    }
+
+    QList<int> wanted = copies.keys();
+    qSort(wanted);
+    for(int j = 0; j < wanted.count() && asked < room; ++j){
+
+      int i = wanted[j];
+      if (source.sent.contains(i) || copies[i] >= ENDGAME_COPIES)
+	continue;
+
+      source.sent[i] = now;
+      download.resent.insert(i);
+      list.append(hashes[i]);
+      ++asked;
+    }
+  }
+
+  // Hash lists go out RANGE_COUNT at a time.
+  for(int j = 0; j < list.count(); j += RANGE_COUNT){
+
+    QMap<QString, QVariant> msg;
+    msg["BlockList"] = list.mid(j, RANGE_COUNT);
+    emit sendDownloadMsg(msg, name);
+  }
+  return asked;
+}
+
+/*
+ * A block of the download arrived from origin: it's no longer
+ * outstanding anywhere. Unless it was asked for more than once its
+ * round trip updates origin's timeout (Jacobson/Karels), and its
+ * window grows by one block per block in slow start, by one block
+ * per window after.
+ */
+void
+FileRequests::ackBlock(const QByteArray &master, const QByteArray &hash, const QString &origin)
+{
+  if (!downloads.contains(master))
+    return;
+
+  DownloadState& download = downloads[master];
+  const QList<QByteArray>& hashes = invertBlockHashes[master];
+  qint64 now = clock.elapsed();
+
+  QHash<QString, SourceState>::iterator s = download.sources.begin();
+  for(; s != download.sources.end(); ++s){
+
+    SourceState& source = s.value();
+    bool acked = false;
+
+    QHash<int, qint64>::iterator it = source.sent.begin();
+    while (it != source.sent.end()){
+
+      if (hashes[it.key()] != hash){
+	++it;
+	continue;
+      }
+
+      if (s.key() == origin && !download.resent.contains(it.key())){
+
+	double rtt = now - it.value();
+	if (source.srtt == 0){
+	  source.srtt = rtt;
+	  source.rttvar = rtt / 2;
+	}
+	else {
+	  source.rttvar = 0.75 * source.rttvar + 0.25 * qAbs(source.srtt - rtt);
+	  source.srtt = 0.875 * source.srtt + 0.125 * rtt;
 	}
-	
+	source.rto = qBound((qint64)MIN_RTO, (qint64)(source.srtt + 4 * source.rttvar), (qint64)MAX_RTO);
       }
+
+      download.resent.remove(it.key());
+      it = source.sent.erase(it);
+      acked = true;
     }
+
+    if (!acked || s.key() != origin)
+      continue;
+
+    source.delivered += 1;
+    source.lastProgress = now;
+    if (source.cwnd < source.ssthresh)
+      source.cwnd += 1;
+    else
+      source.cwnd += 1 / source.cwnd;
+    source.cwnd = qMin(source.cwnd, (double)MAX_CWND);
+  }
+
+  for(int i = download.lost.count() - 1; i >= 0; --i){
+
+    if (hashes[download.lost[i]] == hash)
+      download.lost.removeAt(i);
+  }
+}
+
+/*
+ * Losses here are timeouts (or Busy replies), but the blocks after
+ * a lost one still arrive, so halve the window like a fast
+ * retransmit rather than starting over. Once per round trip.
+ */
+void
+FileRequests::backOff(SourceState *source, qint64 now)
+{
+  if (now < source->recoverUntil)
+    return;
+
+  source->ssthresh = qMax(source->cwnd / 2, (double)MIN_CWND);
+  source->cwnd = source->ssthresh;
+  source->recoverUntil = now + (source->srtt > 0 ? (qint64)source->srtt : source->rto);
+}
+
+// Blocks we're waiting on from this node, all downloads together.
+int
+FileRequests::sourceInFlight(const QString &destination)
+{
+  int count = 0;
+  QHash<QByteArray, DownloadState>::const_iterator it = downloads.constBegin();
+  for(; it != downloads.constEnd(); ++it){
+
+    if (it.value().sources.contains(destination))
+      count += it.value().sources[destination].sent.count();
   }
+  return count;
 }
 
 void
-FileRequests::writeFile(const QByteArray &hash)
+FileRequests::parseList(const QByteArray &master, const QByteArray &data, bool chunked)
 {
+  QList<QByteArray> hashList;
+  int entrySize = chunked ? HASH_SIZE + 4 : HASH_SIZE;
+  const char *buf = data.constData();
+
+  for(int i = 0; i + entrySize <= data.size(); i += entrySize){
+
+    QByteArray temp(&buf[i], HASH_SIZE);
+
+    hashList.append(temp);
+    blockHashes[temp] = master;
+    if (chunked)
+      blockLengths[temp] = qFromBigEndian<quint32>((const uchar *)&buf[i + HASH_SIZE]);
+  }
+  invertBlockHashes[master] = hashList;
+
+  // Nothing of the level before is still wanted.
+  DownloadState& download = downloads[master];
+  int count = hashList.count();
+  download.list = data;
+  download.indexes.clear();
+  for(int i = 0; i < count; ++i)
+    download.indexes[hashList[i]].append(i);
+  download.done = QBitArray(count);
+  download.remaining = count;
+  download.next = 0;
+  download.lost.clear();
+  download.resent.clear();
+
+  QHash<QString, SourceState>::iterator it = download.sources.begin();
+  for(; it != download.sources.end(); ++it)
+    it.value().sent.clear();
+}
+
+/*
+ * Set up the file a download is written to, once its hash list is
+ * in: where each block goes, and Downloads/<name>.part preallocated
+ * to (at least) the size of the file. Resuming, the .part file is
+ * kept as it is. False if it can't be opened or the disk is too
+ * full.
+ */
+bool
+FileRequests::openFile(const QByteArray &master, bool chunked, bool resume)
+{
+  DownloadState& download = downloads[master];
+  const QList<QByteArray>& hashes = invertBlockHashes[master];
+  int count = hashes.count();
+
+  // A fixed-size file's blocks are all BLOCK_SIZE but the last,
+  // chunk lengths come with the lowest level of lists.
+  qint64 offset = 0;
+  download.offsets.resize(count);
+  for(int i = 0; i < count; ++i){
+
+    download.offsets[i] = offset;
+    offset += chunked ? blockLengths.value(hashes[i]) : BLOCK_SIZE;
+  }
+  qint64 expected = chunked ? offset : (qint64)(count - 1) * BLOCK_SIZE;
+
+  download.written.resize(count);
+  download.chunked = chunked;
+
   QDir downloadDir;
   if (!downloadDir.exists("Downloads"))
     downloadDir.mkdir("Downloads");
 
   downloadDir.cd("Downloads");
-  QString fileName = pendingDownloads[hash].first;
+
+  // Names from shared directories are relative paths, keep them
+  // under Downloads whatever the other side sent.
+  QString fileName = QDir::cleanPath(pendingDownloads[master].first);
+  while (fileName.startsWith("../") || fileName.startsWith("/"))
+    fileName = fileName.mid(fileName.indexOf('/') + 1);
+  if (fileName.isEmpty() || fileName == "..")
+    fileName = master.toHex();
+
   QFileInfo fileinf(downloadDir, fileName);
-  
-  QString bigName = fileinf.absoluteFilePath();
-  
-  QFile file(bigName);
-  
-  if (file.exists())
-    file.remove();
-  
-  file.open(QIODevice::WriteOnly);
-  
-  QByteArray fileData;
-  
-  QList<QByteArray> hashes = invertBlockHashes[hash];
-  for(int i = 0;  i < hashes.count(); ++i)    
-    fileData += pendingDownloadData[hashes[i]];
-  
-      
-  file.write(fileData);
-  file.flush();
+  downloadDir.mkpath(fileinf.absolutePath());
+
+  download.fileName = fileinf.absoluteFilePath();
+  download.partName = download.fileName + ".part";
+
+  int flags = resume ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC;
+  download.fd = ::open(download.partName.toLocal8Bit().constData(), flags, 0644);
+  if (download.fd < 0){
+    qDebug() << "FileRequests: couldn't create " << download.partName;
+    return false;
+  }
+
+  // Reserve the space now, rather than run out halfway through.
+  int err = expected > 0 ? ::posix_fallocate(download.fd, 0, expected) : 0;
+  if (err != 0 && err != EOPNOTSUPP && err != EINVAL){
+
+    qDebug() << "FileRequests: no room for " << download.fileName << ": " << strerror(err);
+    ::close(download.fd);
+    ::unlink(download.partName.toLocal8Bit().constData());
+    return false;
+  }
+  return true;
 }
 
+/*
+ * A verified block: write it to every place in the file that has
+ * it. The writes complete in writeDone(), the data isn't kept.
+ */
 void
-FileRequests::destroyDownloadData(const QByteArray &hash)
+FileRequests::storeBlock(const QByteArray &master, const QByteArray &hash, const QByteArray &data)
 {
-  
+  DownloadState& download = downloads[master];
+  if (download.level > 0){
+    storeList(master, hash, data);
+    return;
+  }
+
+  QList<int> blocks = download.indexes.value(hash);
+  int last = download.offsets.count() - 1;
+
+  for(int j = 0; j < blocks.count(); ++j){
+
+    int i = blocks[j];
+    if (download.done.testBit(i))
+      continue;
+
+    // Anything short but the last block would shift the rest.
+    if (!download.chunked && i < last && data.size() != BLOCK_SIZE){
+      qDebug() << "FileRequests: block has the wrong length, dropped";
+      continue;
+    }
+
+    download.done.setBit(i);
+    --download.remaining;
+    if (i == last)
+      download.size = download.offsets[i] + data.size();
+
+    if (!data.isEmpty()){
+      pendingWrites[io.Write(download.fd, download.offsets[i], data)] = qMakePair(master, i);
+      ++download.writes;
+    }
+    else
+      download.written.setBit(i);
+  }
+
+  if (download.remaining == 0 && download.writes == 0)
+    finishFile(master);
 }
 
-bool
-FileRequests::downloadCompleted(const QByteArray &hash)
+/*
+ * A meta-list of a multi-level file. Once every list of the level
+ * is in, in order they make up the level below; when that's the
+ * data blocks the file is set up and the blocks are fetched.
+ */
+void
+FileRequests::storeList(const QByteArray &master, const QByteArray &hash, const QByteArray &data)
 {
-  QList<QByteArray> hashes = invertBlockHashes[hash];
-  int size = hashes.count();
-  
-  for(int i = 0; i < size; ++i){
+  DownloadState& download = downloads[master];
+  QList<int> lists = download.indexes.value(hash);
 
-    if (!pendingDownloadData.contains(hashes[i]))
-      return false;
+  for(int j = 0; j < lists.count(); ++j){
+
+    int i = lists[j];
+    if (download.done.testBit(i))
+      continue;
+
+    download.done.setBit(i);
+    --download.remaining;
+    download.lists[i] = data;
   }
-  return true;
+
+  if (download.remaining > 0)
+    return;
+
+  QByteArray below;
+  for(int i = 0; i < download.lists.count(); ++i)
+    below += download.lists[i];
+  download.lists.clear();
+
+  --download.level;
+  download.ranged = false;
+  parseList(master, below, download.chunked);
+
+  if (download.level > 0){
+    download.lists.resize(invertBlockHashes[master].count());
+    qDebug() << "FileRequests: " << download.lists.count() << " lists on the next level";
+    return;
+  }
+
+  qDebug() << "Expect " << invertBlockHashes[master].count() << " blocks";
+  if (!openFile(master, download.chunked, false)){
+    downloads.remove(master);
+    return;
+  }
+  saveState(master);
+}
+
+void
+FileRequests::writeDone(quint64 id, qint64 result)
+{
+  if (pendingSyncs.contains(id)){
+    syncDone(pendingSyncs.take(id), result);
+    return;
+  }
+
+  // A finished file's directory, the rename in it is durable.
+  if (pendingDirSyncs.contains(id)){
+
+    QPair<int, QString> dir = pendingDirSyncs.take(id);
+    if (result < 0)
+      qDebug() << "FileRequests: couldn't sync the directory of " << dir.second << ": " << strerror(-result);
+    ::close(dir.first);
+    QFile::remove(dir.second);
+    return;
+  }
+
+  if (!pendingWrites.contains(id))
+    return;
+
+  QPair<QByteArray, int> write = pendingWrites.take(id);
+  if (!downloads.contains(write.first))
+    return;
+
+  DownloadState& download = downloads[write.first];
+  --download.writes;
+
+  int i = write.second;
+  qint64 length = i + 1 < download.offsets.count() ?
+    download.offsets[i + 1] - download.offsets[i] : download.size - download.offsets[i];
+
+  // Not all on the disk, so not done: fetch it again.
+  if (result != length){
+
+    if (result < 0)
+      qDebug() << "FileRequests: write to " << download.partName << " failed: " << strerror(-result);
+    else
+      qDebug() << "FileRequests: short write to " << download.partName << ", " << result << " of " << length;
+    download.done.clearBit(i);
+    ++download.remaining;
+    download.lost.append(i);
+    return;
+  }
+
+  download.written.setBit(i);
+  if (download.remaining == 0 && download.writes == 0)
+    finishFile(write.first);
+  else if (++download.unsaved >= STATE_BATCH)
+    saveState(write.first);
+}
+
+/*
+ * Every block is on the disk: trim it, and sync it on DiskIO's
+ * threads. It is moved into place once the sync is done, in
+ * moveFile(). Until then nothing else is saved or written.
+ */
+void
+FileRequests::finishFile(const QByteArray &master)
+{
+  DownloadState& download = downloads[master];
+  if (download.finishing)
+    return;
+
+  if (::ftruncate(download.fd, download.size) < 0){
+
+    qDebug() << "FileRequests: couldn't finish " << download.partName << ": " << strerror(errno);
+    ::close(download.fd);
+    downloads.remove(master);
+    return;
+  }
+
+  download.finishing = true;
+  download.sync = io.Sync(download.fd);
+  pendingSyncs[download.sync] = master;
+  ++download.writes;
+}
+
+/*
+ * The finished file is synced: rename it, and sync its directory
+ * so the rename is durable too. If the file can't be made durable
+ * it stays a .part file, with its progress file, to be resumed on
+ * the next start.
+ */
+void
+FileRequests::moveFile(const QByteArray &master, qint64 result)
+{
+  DownloadState& download = downloads[master];
+  ::close(download.fd);
+
+  if (result < 0){
+    qDebug() << "FileRequests: couldn't finish " << download.partName << ": " << strerror(-result);
+    downloads.remove(master);
+    return;
+  }
+
+  if (::rename(download.partName.toLocal8Bit().constData(), download.fileName.toLocal8Bit().constData()) < 0){
+    qDebug() << "FileRequests: couldn't rename " << download.partName << ": " << strerror(errno);
+    downloads.remove(master);
+    return;
+  }
+  qDebug() << "Download completed! Wrote " << download.fileName;
+
+  // The progress file goes once the directory is synced.
+  QString stateName = download.partName + ".state";
+  QString dirName = QFileInfo(download.fileName).absolutePath();
+  int dirFd = ::open(dirName.toLocal8Bit().constData(), O_RDONLY | O_DIRECTORY);
+  if (dirFd < 0){
+    qDebug() << "FileRequests: couldn't sync " << dirName << ": " << strerror(errno);
+    QFile::remove(stateName);
+  }
+  else
+    pendingDirSyncs[io.Sync(dirFd)] = qMakePair(dirFd, stateName);
+
+  downloads.remove(master);
+}
+
+/*
+ * Save a download's progress to <name>.part.state. The blocks it
+ * lists are synced to the disk first, on DiskIO's threads: the
+ * state never claims more than the .part file holds.
+ */
+void
+FileRequests::saveState(const QByteArray &master)
+{
+  DownloadState& download = downloads[master];
+  if (download.fd < 0 || download.sync != 0)
+    return;
+
+  download.synced = download.written;
+  download.sync = io.Sync(download.fd);
+  pendingSyncs[download.sync] = master;
+  ++download.writes;
+
+  download.unsaved = 0;
+  download.lastSaved = clock.elapsed();
+}
+
+void
+FileRequests::syncDone(const QByteArray &master, qint64 result)
+{
+  if (!downloads.contains(master))
+    return;
+
+  DownloadState& download = downloads[master];
+  --download.writes;
+  download.sync = 0;
+
+  if (download.finishing){
+    moveFile(master, result);
+    return;
+  }
+
+  if (result < 0)
+    qDebug() << "FileRequests: couldn't sync " << download.partName << ": " << strerror(-result);
+  else
+    writeState(master);
+
+  if (download.remaining == 0 && download.writes == 0)
+    finishFile(master);
+}
+
+/*
+ * Write the state through a temporary file, synced, and a rename,
+ * so a crash leaves the old state or the new one.
+ */
+void
+FileRequests::writeState(const QByteArray &master)
+{
+  DownloadState& download = downloads[master];
+  QString stateName = download.partName + ".state";
+  QString tempName = stateName + ".tmp";
+  QFile file(tempName);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)){
+    qDebug() << "FileRequests: couldn't write to " << tempName;
+    return;
+  }
+
+  QDataStream out(&file);
+  out.setVersion(QDataStream::Qt_4_6);
+
+  out << (quint32)STATE_MAGIC << (quint32)STATE_VERSION << me;
+  out << master << pendingDownloads[master].first << pendingDownloads[master].second;
+  out << download.chunked << download.ranged << download.list << download.synced << download.size;
+  out << QStringList(download.sources.keys());
+
+  if (!file.flush() || ::fsync(file.handle()) < 0 ||
+      ::rename(tempName.toLocal8Bit().constData(), stateName.toLocal8Bit().constData()) < 0){
+
+    qDebug() << "FileRequests: couldn't save " << stateName << ": " << strerror(errno);
+    file.close();
+    QFile::remove(tempName);
+    return;
+  }
+  file.close();
+}
+
+// Pick a download up from its progress file.
+void
+FileRequests::loadState(const QString &stateName)
+{
+  QFile file(stateName);
+  if (!file.open(QIODevice::ReadOnly))
+    return;
+
+  QDataStream in(&file);
+  in.setVersion(QDataStream::Qt_4_6);
+
+  quint32 magic, version;
+  QString owner;
+  in >> magic >> version >> owner;
+  if (magic != STATE_MAGIC || version != STATE_VERSION){
+    qDebug() << "FileRequests: " << stateName << " isn't a download we can resume";
+    return;
+  }
+
+  // Nodes started with -instances share the Downloads directory,
+  // each one resumes only what it was downloading.
+  if (owner != me)
+    return;
+
+  QByteArray master, list;
+  QString fileName, destination;
+  bool chunked, ranged;
+  QBitArray written;
+  qint64 size;
+  QStringList sources;
+  in >> master >> fileName >> destination >> chunked >> ranged >> list >> written >> size >> sources;
+  if (in.status() != QDataStream::Ok || pendingDownloads.contains(master)){
+    qDebug() << "FileRequests: couldn't resume from " << stateName;
+    return;
+  }
+
+  pendingDownloads[master] = qMakePair(fileName, destination);
+  downloads[master] = DownloadState();
+  addSource(master, destination);
+  for(int i = 0; i < sources.count(); ++i)
+    addSource(master, sources[i]);
+
+  downloads[master].ranged = ranged;
+  parseList(master, list, chunked);
+  if (written.size() != invertBlockHashes[master].count() ||
+      !openFile(master, chunked, true)){
+
+    qDebug() << "FileRequests: couldn't resume " << fileName;
+    downloads.remove(master);
+    pendingDownloads.remove(master);
+    invertBlockHashes.remove(master);
+    return;
+  }
+
+  DownloadState& download = downloads[master];
+  download.done = written;
+  download.written = written;
+  download.remaining = written.size() - written.count(true);
+  download.size = size;
+  download.lastSaved = clock.elapsed();
+  qDebug() << "FileRequests: resuming " << fileName << ", " << download.remaining << " blocks to go";
+
+  // Crashed between the last write and the rename.
+  if (download.remaining == 0)
+    finishFile(master);
+}
+
+// Downloads a previous run of this node didn't finish, blocks are
+// asked for again on the next download tick.
+void
+FileRequests::resumeDownloads()
+{
+  QDirIterator it("Downloads", QStringList() << "*.part.state", QDir::Files, QDirIterator::Subdirectories);
+  while (it.hasNext())
+    loadState(it.next());
+}
+
+void
+FileRequests::destroyDownloadData(const QByteArray &hash)
+{
+  
 }
 
 bool
 FileRequests::verifyData(const QByteArray &hash, const QByteArray &data)
 {
-  QCA::Hash shaHash("sha256");
-  
-  const char *dataBuf = data.data();
-  quint32 size = data.size();
-  
-  shaHash.update(dataBuf, size);
-  
-  QByteArray computedHash = shaHash.final().toByteArray();
-  
-  return computedHash == hash;
+  return Sha256::Hash(data) == hash;
 }
 
 void
@@ -171,7 +883,11 @@ FileRequests::newSearch(const QString& queryString)
     msg["Origin"] = me;
     msg["Search"] = queryString;
     msg["Budget"] = START_BUDGET;
-    
+
+    // The same id goes out every round, so nodes that have seen
+    // the search already only pass on the extra budget.
+    searchIds[queryString] = nextSearchId++;
+    msg["SearchID"] = searchIds[queryString];
     
     pendingSearches[queryString] = START_BUDGET;
 
@@ -202,6 +918,69 @@ FileRequests::processReply(const QMap<QString, QVariant>&msg)
 
     processBlockReply(msg);
   }
+
+  else if (msg.contains("Dest") &&
+	   msg.contains("Origin") &&
+	   msg.contains("BlockBusy") &&
+	   msg.contains("RetryAfter")){
+
+    processBusy(msg);
+  }
+}
+
+// The node is over its load, leave it alone for a while. The
+// block is asked for again on a later download timeout.
+void
+FileRequests::processBusy(const QMap<QString, QVariant> & msg)
+{
+  QString origin = msg["Origin"].toString();
+  int retryAfter = qBound(0, msg["RetryAfter"].toInt(), 10 * (int)timerDuration);
+
+  QDateTime until = QDateTime::currentDateTime().addMSecs(retryAfter);
+  if (until > busyUntil.value(origin))
+    busyUntil[origin] = until;
+  qDebug() << "FileRequests: " << origin << " is busy for " << retryAfter << " ms";
+
+  // The block won't come, ask for it again once the node is
+  // ready, and take the hint about the window.
+  QByteArray hash = msg["BlockBusy"].toByteArray();
+  QByteArray master = blockHashes.value(hash);
+  if (!downloads.contains(master))
+    return;
+
+  DownloadState& download = downloads[master];
+  if (!download.sources.contains(origin))
+    return;
+
+  SourceState& source = download.sources[origin];
+  const QList<QByteArray>& hashes = invertBlockHashes[master];
+  QHash<int, qint64>::iterator it = source.sent.begin();
+  while (it != source.sent.end()){
+
+    if (hashes[it.key()] == hash){
+      download.lost.append(it.key());
+      it = source.sent.erase(it);
+    }
+    else
+      ++it;
+  }
+  backOff(&source, clock.elapsed());
+
+  // Someone else may have room for it now.
+  scheduleBlocks(master);
+}
+
+bool
+FileRequests::isBusy(const QString &destination)
+{
+  if (!busyUntil.contains(destination))
+    return false;
+
+  if (busyUntil[destination] > QDateTime::currentDateTime())
+    return true;
+
+  busyUntil.remove(destination);
+  return false;
 }
 
 void
@@ -215,13 +994,23 @@ FileRequests::processSearchReply(const QMap<QString, QVariant>& msg)
     //          size always, make sure you account for that!    
     QList<QVariant> names = msg["MatchNames"].toList();
     QList<QVariant> ids = msg["MatchIDs"].toList();
+
+    // Replies from a node's cache say who holds each file.
+    QList<QVariant> holders = msg["Holders"].toList();
     
     for(int i = 0; i < names.count() && i < ids.count(); ++i){
       
       QMap<QString, QVariant> temp;
       temp["Name"] = names[i].toString();
       temp["ID"] = ids[i].toByteArray();
-      temp["Origin"] = msg["Origin"].toString();
+      temp["Origin"] = i < holders.count() ? holders[i].toString() : msg["Origin"].toString();
+
+      // Every holder is a source, for downloads to come and those
+      // already going.
+      QByteArray id = ids[i].toByteArray();
+      fileHolders[id].insert(temp["Origin"].toString());
+      if (downloads.contains(id))
+	addSource(id, temp["Origin"].toString());
      
       // Keep the responses around and signal the UI.
       searchResponses.insertMulti(searchReply, temp);      
@@ -242,44 +1031,94 @@ FileRequests::destroyRequest(const QString& queryString)
 {       
   pendingSearches.remove(queryString);
   searchResponses.remove(queryString); 
+  searchIds.remove(queryString);
   qDebug() << "Destroyed search request " << queryString;
 }
 
+/*
+ * Every DOWNLOAD_TICK, for each source of each download: blocks
+ * outstanding for longer than its timeout are lost, the timeout
+ * doubles and the window shrinks. A source that has delivered
+ * nothing for STALL_TIMEOUT loses all its blocks to the others and
+ * is left alone for as long. Then whatever room there is gets
+ * filled.
+ */
 void
 FileRequests::processDownloadTimeout()
 {
-  downloadTimer.stop();
-  
-  QList<QByteArray> masters = pendingDownloadData.keys();
+  qint64 now = clock.elapsed();
+
+  QList<QByteArray> masters = downloads.keys();
   for(int i = 0; i < masters.count(); ++i){
 
+    DownloadState& download = downloads[masters[i]];
+
+    if (download.unsaved > 0 && now - download.lastSaved > STATE_INTERVAL)
+      saveState(masters[i]);
+
     if (!invertBlockHashes.contains(masters[i])){
-	
 
-	QString destination = pendingDownloads[masters[i]].second;
-	QMap<QString, QVariant> msg;
-	
-	msg["BlockRequest"] = masters[i];
+      if (now - download.listSent > download.listRto){
+	requestList(masters[i], now);
+	download.listRto = qMin(download.listRto * 2, (qint64)MAX_RTO);
+      }
+      continue;
+    }
+
+    bool timedOut = false;
+    QHash<QString, SourceState>::iterator s = download.sources.begin();
+    for(; s != download.sources.end(); ++s){
+
+      SourceState& source = s.value();
+      source.rate = RATE_KEEP * source.rate +
+	(1 - RATE_KEEP) * source.delivered * 1000.0 / DOWNLOAD_TICK;
+      source.delivered = 0;
+
+      if (!source.sent.isEmpty() && now - source.lastProgress > STALL_TIMEOUT){
 
-	emit sendDownloadMsg(msg, destination);
+	qDebug() << "FileRequests: " << s.key() << " stalled, moving its blocks";
+	download.lost += source.sent.keys();
+	source.sent.clear();
+	source.cwnd = MIN_CWND;
+	source.rate = 0;
+	source.stalledUntil = now + STALL_TIMEOUT;
+	timedOut = true;
+	continue;
+      }
+
+      bool lost = false;
+      QHash<int, qint64>::iterator it = source.sent.begin();
+      while (it != source.sent.end()){
+
+	if (now - it.value() > source.rto){
+	  download.lost.append(it.key());
+	  it = source.sent.erase(it);
+	  lost = true;
+	}
+	else
+	  ++it;
+      }
+
+      if (lost){
+	backOff(&source, now);
+	source.rto = qMin(source.rto * 2, (qint64)MAX_RTO);
+	timedOut = true;
       }
-  }
-  
-  QList<QByteArray> keys = blockHashes.keys();
-  for(int i = 0; i < keys.count(); ++i){
-    
-    if (!pendingDownloadData.contains(keys[i])){
-      
-      QString destination = pendingDownloads[blockHashes[keys[i]]].second;
-      
-      QMap<QString, QVariant> msg;
-      
-      msg["BlockRequest"] = keys[i];
-      emit sendDownloadMsg(msg, destination);      
     }
+
+    if (timedOut){
+
+      // A block lost by one source may still be outstanding at
+      // another, in the endgame.
+      qSort(download.lost);
+      for(int j = download.lost.count() - 1; j > 0; --j){
+
+	if (download.lost[j] == download.lost[j - 1])
+	  download.lost.removeAt(j);
+      }
+    }
+    scheduleBlocks(masters[i]);
   }
-  
-  downloadTimer.start();
 }
 
 void
@@ -302,6 +1141,7 @@ FileRequests::processTimeout()
       msg["Origin"] = me;
       msg["Search"] = keys[i];
       msg["Budget"] = currentBudget * 2;
+      msg["SearchID"] = searchIds[keys[i]];
     
       pendingSearches.insert(keys[i], currentBudget * 2);
     
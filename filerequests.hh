@@ -2,6 +2,7 @@
 #define FILEREQUESTS_HH
 
 #include <fileconstants.hh>
+#include <diskio.hh>
 
 #include <QObject>
 #include <QMap>
@@ -12,6 +13,81 @@
 #include <QPair>
 #include <QTimer>
 #include <QByteArray>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QSet>
+#include <QBitArray>
+#include <QVector>
+
+// One node a download fetches from: which blocks we asked it for
+// and when, and the window and timeout pacing it, much like TCP's.
+struct SourceState
+{
+  SourceState()
+    : cwnd(INITIAL_CWND), ssthresh(MAX_CWND), srtt(0), rttvar(0),
+      rto(INITIAL_RTO), recoverUntil(0), rate(0), delivered(0),
+      lastProgress(0), stalledUntil(0) {}
+
+  QHash<int, qint64> sent;  // Block index -> when (ms) we asked for it
+  double cwnd;
+  double ssthresh;
+  double srtt;
+  double rttvar;
+  qint64 rto;
+  qint64 recoverUntil;      // No backing off again before this
+  double rate;              // Blocks per second, smoothed
+  int delivered;            // Blocks since the last tick
+  qint64 lastProgress;      // When it last delivered, or was first asked
+  qint64 stalledUntil;      // Left alone until then
+};
+
+// Where a download stands, across all the nodes holding the file.
+struct DownloadState
+{
+  DownloadState()
+    : next(0), listSent(0), listRto(INITIAL_RTO), listTries(0),
+      remaining(0), level(0), ranged(true), chunked(false), fd(-1),
+      size(-1), writes(0), unsaved(0), lastSaved(0), sync(0), finishing(false) {}
+
+  QHash<QString, SourceState> sources;
+  QSet<int> resent;         // Asked for again, their round trips are ambiguous
+  QList<int> lost;          // Timed out, to be asked for again
+  int next;                 // First block never asked for
+  qint64 listSent;          // When we last asked for the hash list
+  qint64 listRto;
+  int listTries;            // Hash list requests so far, to rotate sources
+
+  // Blocks go straight to their offset in partName as they are
+  // verified, only which ones are done is kept in memory.
+  QBitArray done;
+  int remaining;            // Blocks not yet done
+  QVector<qint64> offsets;
+  QHash<QByteArray, QList<int> > indexes;  // Hash -> the blocks that have it
+
+  // Files too big for one list are fetched a level at a time: the
+  // meta-lists of each level are kept until the whole level is in,
+  // then together they are the next level's list.
+  int level;                // Levels above the data, 0 once fetching it
+  QVector<QByteArray> lists;
+  bool ranged;              // The blocks are the master's own entries
+  bool chunked;
+  int fd;
+  QString partName;
+  QString fileName;
+  qint64 size;              // Final size, once the last block is in
+  int writes;               // Writes (and syncs) still in flight
+
+  // Progress saved next to the .part file, so the download picks
+  // up where it was after a restart: the hash list, and the blocks
+  // known to be on the disk.
+  QByteArray list;
+  QBitArray written;
+  int unsaved;              // Blocks written since the last save
+  qint64 lastSaved;
+  quint64 sync;             // Sync of partName the save waits on, 0 if none
+  QBitArray synced;         //   and the blocks it covers
+  bool finishing;           // All in, the final sync is in flight
+};
 
 class FileRequests : public QObject
 {
@@ -57,6 +133,9 @@ public slots:
   void
   destroyRequest(const QString& queryString);
 
+  void
+  writeDone(quint64 id, qint64 result);
+
 
 
 private:  
@@ -65,13 +144,67 @@ private:
   processBlockReply(const QMap<QString, QVariant> & msg);
   
   void
-  writeFile(const QByteArray &hash);
-  
+  processBusy(const QMap<QString, QVariant> & msg);
+
+  bool
+  isBusy(const QString &destination);
+
   void
-  destroyDownloadData(const QByteArray &hash);
+  scheduleBlocks(const QByteArray &master);
+
+  int
+  fillSource(const QByteArray &master, const QString &source, int room, qint64 now);
+
+  void
+  ackBlock(const QByteArray &master, const QByteArray &hash, const QString &origin);
+
+  void
+  backOff(SourceState *source, qint64 now);
+
+  void
+  addSource(const QByteArray &master, const QString &origin);
+
+  void
+  requestList(const QByteArray &master, qint64 now);
+
+  int
+  sourceInFlight(const QString &destination);
+
+  void
+  parseList(const QByteArray &master, const QByteArray &data, bool chunked);
 
   bool
-  downloadCompleted(const QByteArray &hash);
+  openFile(const QByteArray &master, bool chunked, bool resume);
+
+  void
+  saveState(const QByteArray &master);
+
+  void
+  syncDone(const QByteArray &master, qint64 result);
+
+  void
+  writeState(const QByteArray &master);
+
+  void
+  loadState(const QString &stateName);
+
+  void
+  resumeDownloads();
+
+  void
+  storeBlock(const QByteArray &master, const QByteArray &hash, const QByteArray &data);
+
+  void
+  storeList(const QByteArray &master, const QByteArray &hash, const QByteArray &data);
+
+  void
+  finishFile(const QByteArray &master);
+
+  void
+  moveFile(const QByteArray &master, qint64 result);
+  
+  void
+  destroyDownloadData(const QByteArray &hash);
 
   bool
   verifyData(const QByteArray &hash, const QByteArray &data);
@@ -81,17 +214,37 @@ private:
   
   QHash<QString, QMap<QString, QVariant> > searchResponses;
   QHash<QString, quint32> pendingSearches;  
+  QHash<QString, quint32> searchIds;
+  quint32 nextSearchId;
 
   QHash<QByteArray, QPair<QString, QString> > pendingDownloads;
-  QHash<QByteArray, QByteArray> pendingDownloadData;
   QHash<QByteArray, QByteArray> blockHashes;
+  QHash<QByteArray, quint32> blockLengths;
   QHash<QByteArray, QList<QByteArray> >invertBlockHashes;
+
+  // Downloads in progress, by master block. Blocks are asked for
+  // from every node known to hold the file, as each one's
+  // congestion window opens, and again once their retransmission
+  // timeout passes.
+  QHash<QByteArray, DownloadState> downloads;
+
+  // Nodes search replies named for each master block.
+  QHash<QByteArray, QSet<QString> > fileHolders;
+  QElapsedTimer clock;
+
+  // Nodes that told us they are busy, and until when.
+  QHash<QString, QDateTime> busyUntil;
   
   QTimer timer;
   QString me;
   quint32 timerDuration;
   QTimer downloadTimer;
 
+  DiskIO io;
+  QHash<quint64, QPair<QByteArray, int> > pendingWrites;  // Write -> download and block
+  QHash<quint64, QByteArray> pendingSyncs;                // Sync -> download
+  QHash<quint64, QPair<int, QString> > pendingDirSyncs;   // Sync -> directory and progress file
+
 };
 
 #endif // FILEREQUESTS_HH
@@ -1,5 +1,8 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
 #include <QDebug>
-#include <QtCrypto>
 #include <QFile>
 #include <QByteArray>
 #include <QPair>
@@ -7,70 +10,724 @@
 #include <QString>
 #include <QVariant>
 #include <QFileInfo>
+#include <QDir>
+#include <QtEndian>
+#include <QDataStream>
+#include <QReadLocker>
+#include <QWriteLocker>
+#include <QMutexLocker>
 
 #include <files.hh>
 
-/*
- * We have to take a lot of care while hashing because 
- * the data() member of the ByteArray returns a \0 terminated
- * string. The padding should *not* affect the result of 
- * the way we do hashing. 
- * 
- * We have to always specify the number of bytes we want to hash
- * and the number of bytes we read from the data buffer into
- * the stream.
- */
+WorkerFiles::~WorkerFiles()
+{
+  QList<int> open = fds.values();
+  for(int i = 0; i < open.count(); ++i)
+    ::close(open[i]);
+}
 
 FileStore::FileStore()
+  : cache(BLOCK_CACHE_SIZE)
 {
+  // The indexer hashes on its own threads, the results are
+  // committed here, on the event loop, one file at a time.
+  connect(&indexer, SIGNAL(fileIndexed(const IndexedFile&)),
+	  this, SLOT(CommitFile(const IndexedFile&)));
+
+  connect(&indexer, SIGNAL(indexProgress(const QString&, qint64, qint64)),
+	  this, SIGNAL(indexProgress(const QString&, qint64, qint64)));
+
+  connect(&watcher, SIGNAL(fileChanged(const QString&)),
+	  this, SLOT(FileChanged(const QString&)));
+
+  connect(&watcher, SIGNAL(directoryChanged(const QString&)),
+	  this, SLOT(DirectoryChanged(const QString&)));
+
+  // Files found in shared trees are taken as the indexer catches up.
+  connect(&walker, SIGNAL(filesReady()),
+	  this, SLOT(FeedIndexer()));
+
+  connect(&walker, SIGNAL(walkFinished()),
+	  this, SLOT(FeedIndexer()));
+
+  connect(&indexer, SIGNAL(indexingFinished()),
+	  this, SLOT(FeedIndexer()));
+
+  directoriesDirty = false;
+  reindexTimer.setSingleShot(true);
+  reindexTimer.setInterval(REINDEX_DELAY);
+  connect(&reindexTimer, SIGNAL(timeout()),
+	  this, SLOT(ReindexChanged()));
 
+  watchTimer.setSingleShot(true);
+  watchTimer.setInterval(0);
+  connect(&watchTimer, SIGNAL(timeout()),
+	  this, SLOT(AddWatches()));
 }
 
 /*
  * Given a list of files returned by the user, index
- * their information.
+ * their information. This only queues the files, the
+ * blocks become available as each file is committed.
  */
 void 
 FileStore::IndexFiles(const QStringList& inputFiles)
 {
-  for(int i = 0; i < inputFiles.count(); ++i)
-    IndexSingleFile(inputFiles[i]);
+  QStringList changed;
+  for(int i = 0; i < inputFiles.count(); ++i){
+
+    FileSignature current;
+    if (fileSignatures.contains(inputFiles[i]) &&
+	FileIndexer::Signature(inputFiles[i], &current) &&
+	current == fileSignatures[inputFiles[i]]){
+
+      qDebug() << "File store: " << inputFiles[i] << " is already indexed.";
+      continue;
+    }
+    changed.append(inputFiles[i]);
+  }
+
+  indexer.IndexFiles(changed);
+}
+
+// Cut files at content-defined boundaries, set before LoadIndex().
+void
+FileStore::SetChunking(bool chunked)
+{
+  indexer.SetChunking(chunked);
+}
+
+// The hashes at [start, start + count) of a meta-list we share,
+// for range requests. False if we don't have the list.
+bool
+FileStore::ListEntries(const QByteArray& list, int start, int count, QList<QByteArray> *hashes)
+{
+  quint32 slot = blocks.Find(list);
+  if (slot == NO_SLOT || !metaBlocks.contains(slot) || start < 0)
+    return false;
+
+  const QByteArray& data = metaBlocks[slot];
+  int entrySize = chunkLists.contains(slot) ? HASH_SIZE + 4 : HASH_SIZE;
+
+  // Start and Count come off the wire, keep the sums in range.
+  qint64 entries = data.size() / entrySize;
+  if (start >= entries || count <= 0)
+    return true;
+
+  qint64 end = qMin((qint64)start + count, entries);
+  for(qint64 i = start; i < end; ++i)
+    hashes->append(data.mid(i * entrySize, HASH_SIZE));
+  return true;
+}
+
+void
+FileStore::CancelIndexing()
+{
+  walker.Cancel();
+  indexer.CancelIndexing();
 }
 
 /*
- * Index the information of a single file. 
+ * Share every file under a directory that passes the include and
+ * exclude patterns. The tree is walked in the background, and its
+ * files are indexed like any other.
  */
 void
-FileStore::IndexSingleFile(const QString& inputFile)
+FileStore::ShareDirectory(const QString& dirName, const QStringList& includes, const QStringList& excludes)
 {
-  
-  QFile file(inputFile);
-  if (!file.open(QIODevice::ReadOnly)){
-    
-    qDebug() << "File store: file " << inputFile << " not found.";
+  SharedDirectory dir;
+  dir.path = QDir(dirName).absolutePath();
+  dir.includes = includes;
+  dir.excludes = excludes;
+
+  int root = SharedRoot(dir.path);
+  if (root >= 0 && sharedDirs[root].path == dir.path)
+    sharedDirs[root] = dir;
+  else
+    sharedDirs.append(dir);
+  SaveDirectories();
+
+  // Files already shared from this tree are now named relative to it.
+  QList<quint32> ids = fileMeta.keys();
+  for(int i = 0; i < ids.count(); ++i){
+
+    QString name = DisplayName(filePaths[ids[i]]);
+    if (!fileSignatures.contains(filePaths[ids[i]]) || name == fileNames[ids[i]])
+      continue;
+
+    searchIndex.Remove(ids[i], fileNames[ids[i]]);
+    fileNames[ids[i]] = name;
+    searchIndex.Insert(ids[i], name);
+  }
+
+  qDebug() << "File store: sharing directory " << dir.path;
+  directoriesDirty = true;
+  walker.Walk(dir.path, dir.includes, dir.excludes);
+}
+
+/*
+ * Hand the files the walker found to the indexer, without letting
+ * more than WALK_QUEUE of them wait there. Once everything is
+ * hashed, bring the directory manifests up to date.
+ */
+void
+FileStore::FeedIndexer()
+{
+  int room = WALK_QUEUE - indexer.Pending();
+  while (room > 0){
+
+    QStringList found = walker.Take(room);
+    if (found.isEmpty())
+      break;
+
+    IndexFiles(found);
+    room = WALK_QUEUE - indexer.Pending();
+  }
+
+  if (walker.Idle() && indexer.Pending() == 0)
+    UpdateDirectories();
+}
+
+/*
+ * Publish a freshly hashed file. All of its blocks are
+ * inserted before we return to the event loop, so requests
+ * never see a partially indexed file.
+ */
+void
+FileStore::CommitFile(const IndexedFile& file)
+{
+  PublishFile(file);
+  AppendIndex(file);
+  qDebug() << "File store: indexed " << file.fileName << ", "
+	   << blocks.Count() << " unique blocks shared";
+  FeedIndexer();
+}
+
+/*
+ * Stop sharing a file. Blocks it has in common with other
+ * shared files stay available from those.
+ */
+void
+FileStore::UnshareFile(const QString& fileName)
+{
+  if (!fileIds.contains(fileName))
+    return;
+
+  quint32 fileId = fileIds[fileName];
+  if (!fileBlocks.contains(fileId))
     return;
+
+  UnpublishFile(fileId);
+  Unwatch(fileName);
+  fileSignatures.remove(fileName);
+
+  // An empty master records the removal in the on-disk index.
+  IndexedFile removal;
+  removal.fileName = fileName;
+  removal.chunked = false;
+  removal.level = 0;
+  AppendIndex(removal);
+  qDebug() << "File store: unshared " << fileName;
+}
+
+void
+FileStore::UnpublishFile(quint32 fileId)
+{
+  QVector<quint32> slots = fileBlocks.take(fileId);
+  for(int i = 0; i < slots.count(); ++i)
+    UnmapBlock(slots[i], fileId);
+
+  if (fileMeta.contains(fileId)){
+    searchIndex.Remove(fileId, fileNames.take(fileId));
+    fileMeta.remove(fileId);
   }
-  
-  
-  QDataStream fileStream(&file);
-  HashBlocks(fileStream, inputFile, 0);
+  directoriesDirty = true;
 
-  /*
-  QList<QVariant> fileHash = ConvertBytes(HashFinalBlock(HashBlocks(fileStream)));
-  
-  qDebug() << "Hashed " << inputFile << ". Num levels = " << fileHash.count();
+  // The file may have been replaced, forget how it was being read.
+  QMutexLocker locker(&streamLock);
+  streams.remove(fileId);
+}
 
-  QMap<QString, QVariant> fileDetails;
-  fileDetails["size"] = size;
-  fileDetails["hash"] = fileHash;
-  
-  if (files.contains(inputFile)){
-    qDebug() << "File " << inputFile << " already exists.";
-    files.remove(inputFile);
+void
+FileStore::PublishFile(const IndexedFile& file)
+{
+  quint32 fileId = FileId(file.fileName);
+
+  // Drop what an older version of the file contributed first.
+  if (fileBlocks.contains(fileId))
+    UnpublishFile(fileId);
+
+  QVector<quint32> slots;
+  slots.reserve(file.blocks.count());
+  for(int i = 0; i < file.blocks.count(); ++i){
+    MapBlock(file.blocks[i], fileId, file.chunked);
+    slots.append(blocks.Find(file.blocks[i].hash));
   }
+  fileBlocks[fileId] = slots;
   
-  files[inputFile] = fileDetails;
-  */
+  MapMaster(file.master, file.level, fileId, DisplayName(file.fileName));
+  fileSignatures[file.fileName] = file.signature;
+  Watch(file.fileName);
+  directoriesDirty = true;
+}
+
+/*
+ * A shared file was written to, replaced or removed. Wait for the
+ * writes to settle before looking at it, a file being built or
+ * copied changes many times in a row.
+ */
+void
+FileStore::FileChanged(const QString& fileName)
+{
+  // The watch is on the inode: it's gone once the file is removed
+  // or replaced by a rename, Watch() the new one once it has been
+  // looked at. A file written in place keeps its watch, every write
+  // just pushes the rehash back.
+  FileSignature current;
+  if (!FileIndexer::Signature(fileName, &current) ||
+      current.inode != fileSignatures.value(fileName).inode){
+    watchedFiles.remove(fileName);
+    watcher.removePath(fileName);
+  }
+
+  pendingChanges.insert(fileName);
+  reindexTimer.start();
+}
+
+// Files were added, removed or renamed in a directory we watch.
+void
+FileStore::DirectoryChanged(const QString& dirName)
+{
+  // New files in a shared tree, looked for once things are quiet.
+  if (SharedRoot(dirName) >= 0){
+    changedDirs.insert(dirName);
+    reindexTimer.start();
+  }
+
+  if (!watchedDirs.contains(dirName))
+    return;
+
+  // Shared files that lost their watch may be back, renamed in
+  // place of the old one by an editor or a build.
+  QList<QString> files = watchedDirs[dirName].toList();
+  for(int i = 0; i < files.count(); ++i){
+
+    if (!watchedFiles.contains(files[i]))
+      pendingChanges.insert(files[i]);
+  }
+
+  if (!pendingChanges.isEmpty())
+    reindexTimer.start();
+}
+
+/*
+ * Rehash the files that changed. IndexFiles() skips the ones whose
+ * signature is the same after all, and each rehashed file replaces
+ * its old blocks in a single CommitFile().
+ */
+void
+FileStore::ReindexChanged()
+{
+  WalkChanged();
+
+  QStringList changed;
+  QList<QString> files = pendingChanges.toList();
+  pendingChanges.clear();
+
+  for(int i = 0; i < files.count(); ++i){
+
+    if (!fileSignatures.contains(files[i]))
+      continue;
+
+    if (QFileInfo(files[i]).isFile()){
+      Watch(files[i]);
+      changed.append(files[i]);
+    }
+    else
+      UnshareFile(files[i]);
+  }
+
+  qDebug() << "File store: " << changed.count() << " shared files changed on disk";
+  IndexFiles(changed);
+}
+
+/*
+ * List the shared directories that changed, each once however many
+ * events it had. Only the directory itself is listed again, and
+ * subdirectories we share nothing under, which must be new, are
+ * walked whole.
+ */
+void
+FileStore::WalkChanged()
+{
+  if (changedDirs.isEmpty())
+    return;
+
+  // The directories of the shared files, and those above them.
+  QSet<QString> known;
+  QList<QString> watched = watchedDirs.keys();
+  for(int i = 0; i < watched.count(); ++i){
+
+    QString dirName = watched[i];
+    while (SharedRoot(dirName) >= 0 && !known.contains(dirName)){
+      known.insert(dirName);
+      dirName = QFileInfo(dirName).absolutePath();
+    }
+  }
+
+  QList<QString> dirs = changedDirs.toList();
+  changedDirs.clear();
+
+  for(int i = 0; i < dirs.count(); ++i){
+
+    int root = SharedRoot(dirs[i]);
+    if (root < 0)
+      continue;
+
+    const SharedDirectory& shared = sharedDirs[root];
+    walker.Walk(dirs[i], shared.includes, shared.excludes, false);
+
+    QFileInfoList subdirs = QDir(dirs[i]).entryInfoList(QDir::Dirs | QDir::Hidden | QDir::NoDotAndDotDot);
+    for(int j = 0; j < subdirs.count(); ++j){
+
+      const QFileInfo& subdir = subdirs[j];
+      if (subdir.isSymLink() || known.contains(subdir.absoluteFilePath()) ||
+	  DirectoryWalker::Matches(subdir.fileName(), shared.excludes))
+	continue;
+
+      walker.Walk(subdir.absoluteFilePath(), shared.includes, shared.excludes);
+    }
+  }
+}
+
+/*
+ * Watch a shared file and its directory. Restoring the index or
+ * sharing a tree publishes thousands of files in a row, so the
+ * paths are handed to the watcher together, with one addPaths()
+ * once we are back in the event loop.
+ */
+void
+FileStore::Watch(const QString& fileName)
+{
+  if (!watchedFiles.contains(fileName)){
+    watchedFiles.insert(fileName);
+    newWatches.insert(fileName);
+  }
+
+  QString dirName = QFileInfo(fileName).absolutePath();
+  if (!watchedDirs.contains(dirName))
+    newWatches.insert(dirName);
+  watchedDirs[dirName].insert(fileName);
+
+  if (!watchTimer.isActive())
+    watchTimer.start();
+}
+
+void
+FileStore::AddWatches()
+{
+  if (!newWatches.isEmpty())
+    watcher.addPaths(newWatches.toList());
+  newWatches.clear();
+}
+
+void
+FileStore::Unwatch(const QString& fileName)
+{
+  if (watchedFiles.remove(fileName) && !newWatches.remove(fileName))
+    watcher.removePath(fileName);
+
+  QString dirName = QFileInfo(fileName).absolutePath();
+  if (!watchedDirs.contains(dirName))
+    return;
+
+  watchedDirs[dirName].remove(fileName);
+  if (watchedDirs[dirName].isEmpty()){
+    watchedDirs.remove(dirName);
+    if (!newWatches.remove(dirName))
+      watcher.removePath(dirName);
+  }
+}
+
+/*
+ * Restore the files indexed in a previous run. A file whose size,
+ * mtime and inode are unchanged is published as is, one that
+ * changed is hashed again, one that is gone is forgotten.
+ */
+void
+FileStore::LoadIndex(const QString& fileName)
+{
+  indexFile = fileName;
+  QHash<QString, IndexedFile> records;
+  LoadDirectories();
+
+  QFile file(indexFile);
+  if (file.open(QIODevice::ReadOnly)){
+
+    QDataStream in(&file);
+    in.setVersion(QDataStream::Qt_4_6);
+
+    quint32 magic = 0, version = 0;
+    in >> magic >> version;
+
+    if (magic != INDEX_MAGIC || version != INDEX_VERSION)
+      qDebug() << "File store: ignoring unknown index " << indexFile;
+
+    else {
+      while (!in.atEnd()){
+
+	IndexedFile record;
+	in >> record;
+
+	// A torn write at the end of the log, keep what we have.
+	if (in.status() != QDataStream::Ok)
+	  break;
+
+	if (record.master.isEmpty())
+	  records.remove(record.fileName);
+	else
+	  records[record.fileName] = record;
+      }
+    }
+  }
+
+  QList<IndexedFile> unchanged;
+  QStringList changed;
+
+  QList<QString> paths = records.keys();
+  for(int i = 0; i < paths.count(); ++i){
+
+    FileSignature current;
+    if (!FileIndexer::Signature(paths[i], &current))
+      continue;
+
+    // Files indexed in the other chunking mode are cut again.
+    if (current == records[paths[i]].signature &&
+	records[paths[i]].chunked == indexer.Chunking()){
+      PublishFile(records[paths[i]]);
+      unchanged.append(records[paths[i]]);
+    }
+    else
+      changed.append(paths[i]);
+  }
+
+  qDebug() << "File store: restored " << unchanged.count() << " files, rehashing " << changed.count();
+  WriteIndex(unchanged);
+  indexer.IndexFiles(changed);
+
+  // Pick up files added to the shared trees while we were down.
+  directoriesDirty = true;
+  for(int i = 0; i < sharedDirs.count(); ++i)
+    walker.Walk(sharedDirs[i].path, sharedDirs[i].includes, sharedDirs[i].excludes);
+}
+
+// The shared directories are kept next to the index, in their own file.
+void
+FileStore::LoadDirectories()
+{
+  QFile file(indexFile + ".dirs");
+  if (!file.open(QIODevice::ReadOnly))
+    return;
+
+  QDataStream in(&file);
+  in.setVersion(QDataStream::Qt_4_6);
+
+  quint32 magic = 0, version = 0;
+  in >> magic >> version;
+  if (magic != INDEX_MAGIC || version != INDEX_VERSION)
+    return;
+
+  while (!in.atEnd()){
+
+    SharedDirectory dir;
+    in >> dir.path >> dir.includes >> dir.excludes;
+    if (in.status() != QDataStream::Ok)
+      break;
+    sharedDirs.append(dir);
+  }
+}
+
+void
+FileStore::SaveDirectories()
+{
+  if (indexFile.isEmpty())
+    return;
+
+  QString dirsFile = indexFile + ".dirs";
+  QString tempName = dirsFile + ".tmp";
+  QFile file(tempName);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)){
+    qDebug() << "File store: couldn't write to " << tempName;
+    return;
+  }
+
+  QDataStream out(&file);
+  out.setVersion(QDataStream::Qt_4_6);
+
+  out << (quint32)INDEX_MAGIC << (quint32)INDEX_VERSION;
+  for(int i = 0; i < sharedDirs.count(); ++i)
+    out << sharedDirs[i].path << sharedDirs[i].includes << sharedDirs[i].excludes;
+
+  file.close();
+  ::rename(tempName.toLocal8Bit().constData(), dirsFile.toLocal8Bit().constData());
+}
+
+// Index of the shared directory holding this path, or -1.
+int
+FileStore::SharedRoot(const QString& fileName)
+{
+  for(int i = 0; i < sharedDirs.count(); ++i){
+
+    const QString& root = sharedDirs[i].path;
+    if (fileName == root || fileName.startsWith(root + "/"))
+      return i;
+  }
+  return -1;
+}
+
+// The name a file is searched and offered by: relative to the
+// parent of its shared directory, or just the file name.
+QString
+FileStore::DisplayName(const QString& fileName)
+{
+  int root = SharedRoot(fileName);
+  if (root < 0)
+    return QFileInfo(fileName).fileName();
+
+  QDir parent = QFileInfo(sharedDirs[root].path).absoluteDir();
+  return parent.relativeFilePath(fileName);
+}
+
+void
+FileStore::UpdateDirectories()
+{
+  if (!directoriesDirty)
+    return;
+
+  for(int i = 0; i < sharedDirs.count(); ++i)
+    PublishManifest(sharedDirs[i]);
+  directoriesDirty = false;
+}
+
+/*
+ * A shared directory is offered as a manifest: one line per file,
+ * with its master block, its size and its name, sorted by name.
+ * The manifest is cut and hashed like a file, but its blocks are
+ * kept in memory, and it is searchable under "name/".
+ */
+void
+FileStore::PublishManifest(const SharedDirectory& dir)
+{
+  QStringList lines;
+  QList<quint32> ids = fileMeta.keys();
+  for(int i = 0; i < ids.count(); ++i){
+
+    const QString& path = filePaths[ids[i]];
+    if (!path.startsWith(dir.path + "/") || !fileSignatures.contains(path))
+      continue;
+
+    lines.append(blocks.Hash(fileMeta[ids[i]].master).toHex() + " " +
+		 QString::number(fileSignatures[path].size) + " " +
+		 fileNames[ids[i]]);
+  }
+  lines.sort();
+
+  QByteArray manifest;
+  for(int i = 0; i < lines.count(); ++i)
+    manifest += lines[i].toUtf8() + "\n";
+
+  IndexedFile file;
+  file.fileName = dir.path;
+  file.chunked = false;
+
+  QByteArray hashes;
+  for(int offset = 0; ; offset += BLOCK_SIZE){
+
+    IndexedBlock block;
+    block.data = manifest.mid(offset, BLOCK_SIZE);
+    block.hash = FileIndexer::Hash(block.data);
+    block.offset = offset;
+    block.length = block.data.size();
+    block.level = 0;
+
+    file.blocks.append(block);
+    hashes += block.hash;
+
+    if (block.data.size() < BLOCK_SIZE)
+      break;
+  }
+  IndexJob::HashMetaLevels(hashes, false, &file);
+
+  quint32 dirId = FileId(dir.path);
+  if (fileMeta.contains(dirId) && blocks.Hash(fileMeta[dirId].master) == file.master)
+    return;
+
+  if (fileBlocks.contains(dirId))
+    UnpublishFile(dirId);
+
+  QWriteLocker locker(&indexLock);
+  QVector<quint32> slots;
+  for(int i = 0; i < file.blocks.count(); ++i){
+
+    const IndexedBlock& block = file.blocks[i];
+    quint32 slot = blocks.Insert(block.hash);
+    if (blocks.Refs(slot) == 0){
+      blocks.Length(slot) = block.length;
+      blocks.Level(slot) = block.level;
+    }
+    blocks.Refs(slot) += 1;
+
+    if (!metaBlocks.contains(slot))
+      metaBlocks[slot] = block.data;
+    slots.append(slot);
+  }
+  fileBlocks[dirId] = slots;
+  locker.unlock();
+
+  MapMaster(file.master, file.level, dirId, DisplayName(dir.path) + "/");
+  qDebug() << "File store: " << dir.path << " lists " << lines.count() << " files";
+}
+
+void
+FileStore::AppendIndex(const IndexedFile& record)
+{
+  if (indexFile.isEmpty())
+    return;
+
+  QFile file(indexFile);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Append)){
+    qDebug() << "File store: couldn't write to " << indexFile;
+    return;
+  }
+
+  QDataStream out(&file);
+  out.setVersion(QDataStream::Qt_4_6);
+
+  if (file.size() == 0)
+    out << (quint32)INDEX_MAGIC << (quint32)INDEX_VERSION;
+  out << record;
+}
+
+// Replace the index with just these records.
+void
+FileStore::WriteIndex(const QList<IndexedFile>& records)
+{
+  QString tempName = indexFile + ".tmp";
+  QFile file(tempName);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)){
+    qDebug() << "File store: couldn't write to " << tempName;
+    return;
+  }
+
+  QDataStream out(&file);
+  out.setVersion(QDataStream::Qt_4_6);
+
+  out << (quint32)INDEX_MAGIC << (quint32)INDEX_VERSION;
+  for(int i = 0; i < records.count(); ++i)
+    out << records[i];
+
+  file.close();
+  ::rename(tempName.toLocal8Bit().constData(), indexFile.toLocal8Bit().constData());
 }
 
 QList<QVariant>
@@ -100,184 +757,273 @@ FileStore::ConvertBytes(const QList<QByteArray>&bytes)
 }
 
 
-/*
- * Recursively hash the blocks of a file along
- *  with the meta list.
- */
-void
-FileStore::HashBlocks(QDataStream& s, const QString& fileName, quint32 level)
-{  
-  char data[BLOCK_SIZE];
-  int numRead;
-  
-  QByteArray result;
-  // QDataStream resultStream(&result, QIODevice::Append);  
-
-  int count = 0;
-  while((numRead = s.readRawData(data, BLOCK_SIZE)) != -1){
-    
-    QByteArray hash = Hash(data, numRead);
-    MapBlock(hash, data, numRead, fileName, level);
-    
-    result += hash;
-    ++count;
-    if (numRead < BLOCK_SIZE)
-      break;
-    
+// The first four bytes of a hash, as a number.
+quint32
+FileStore::ConvertHash(const QByteArray& arr)
+{
+  if (arr.size() < 4){
+    qDebug() << "Couldn't convert hash to uint";
+    *((int *)NULL) = 1;      
   }
   
-  qDebug() << "Hashed " << count << " blocks";
-  qDebug() << "num hashes = " << (result.size() / 32);
-  if (result.size() % 32 != 0){
-    
-    qDebug() << "Hash result is not a multiple of 32";
-    *((int *)NULL) = 1;             
+  return qFromBigEndian<quint32>((const uchar *)arr.constData());
+}
+
+void
+FileStore::MapMaster(const QByteArray& hash,
+		     quint32 level,
+		     quint32 fileId,
+		     const QString& name)
+{
+  SharedFile shared;
+  shared.master = blocks.Find(hash);
+  shared.level = level;
+
+  fileMeta[fileId] = shared;
+  fileNames[fileId] = name;
+  searchIndex.Insert(fileId, name);
+}
+
+void
+FileStore::MapBlock(const IndexedBlock& block, quint32 fileId, bool chunked)
+{
+  QWriteLocker locker(&indexLock);
+  quint32 slot = blocks.Insert(block.hash);
+  if (slot == NO_SLOT)
+    return;
+
+  if (blocks.Refs(slot) == 0){
+    blocks.Length(slot) = block.length;
+    blocks.Level(slot) = block.level;
   }
-  
-  if (result.size() > BLOCK_SIZE){
-    
-    QDataStream resultROStream(&result, QIODevice::ReadOnly);
-    HashBlocks(resultROStream, fileName, level+1);
-  }  
-  
-  // We need to add one more master block.
-  else {
-    
-    QByteArray hash = Hash(result.data(), result.size());
-    MapBlock(hash, result.data(), result.size(), fileName, level+1);    
-    MapMaster(hash, level+1, fileName);
-    qDebug() << hash << " done";
-    qDebug() << hash.size();
+  blocks.Refs(slot) += 1;
+
+  if (block.level == 0)
+    blocks.AddLocation(slot, fileId, block.offset);
+  else if (!metaBlocks.contains(slot)){
+    metaBlocks[slot] = block.data;
+    if (chunked)
+      chunkLists.insert(slot);
   }
 }
 
-
-QByteArray
-FileStore::Hash(const char *data, int size)
+// Drop one reference, and the block once nothing refers to it.
+void
+FileStore::UnmapBlock(quint32 slot, quint32 fileId)
 {
-  QCA::Hash shaHash("sha256");
-  
-  shaHash.update(data, size);
-  QByteArray temp = shaHash.final().toByteArray();
-  if (temp.size() != HASH_SIZE){
-    qDebug() << "Unexpected hash size";
-    *((int *)NULL) = 1;        
+  if (slot == NO_SLOT)
+    return;
+
+  QWriteLocker locker(&indexLock);
+  blocks.RemoveLocation(slot, fileId);
+
+  if (--blocks.Refs(slot) == 0){
+
+    cacheLock.lock();
+    cache.Remove(slot);
+    cacheLock.unlock();
+    blocks.Remove(slot);
+    metaBlocks.remove(slot);
+    chunkLists.remove(slot);
   }
-  return temp;
-  
 }
 
 quint32
-FileStore::ConvertHash(const QByteArray& arr)
+FileStore::FileId(const QString& fileName)
 {
-  bool ok;
-  QString hashAsString = QCA::arrayToHex(arr);
-  qDebug() << hashAsString;
-  quint32 hash = hashAsString.toUInt(&ok, 16);
-  
-  if (!ok){
-    qDebug() << "Couldn't convert hash to uint";
-    *((int *)NULL) = 1;      
+  if (!fileIds.contains(fileName)){
+    
+    QWriteLocker locker(&indexLock);
+    fileIds[fileName] = filePaths.count();
+    filePaths.append(fileName);
   }
-  
-  return hash;
+  return fileIds[fileName];
 }
 
+/*
+ * Once a file has been read sequentially READAHEAD_RUN times, keep
+ * the kernel READAHEAD_SIZE ahead of the reader, so the next
+ * requests for it don't wait on the disk. Peers fetching the same
+ * file each get a stream of their own, up to READAHEAD_STREAMS of
+ * them: a read carries on the stream that ends where it starts.
+ */
 void
-FileStore::MapMaster(QByteArray hash,
-		     quint32 level,
-		     const QString& fileName)
+FileStore::ReadAhead(quint32 fileId, int fd, qint64 offset, quint32 length)
 {
-  QFileInfo fileInfo(fileName);
-  QMap<QString, QVariant> val;
-  
-  val["fullname"] = fileName;
-  val["level"] = level;
-  val["block"] = hash;
+  QMutexLocker locker(&streamLock);
+  QList<ReadStream>& fileStreams = streams[fileId];
 
-  fileMeta.insertMulti(fileInfo.fileName(), val);
-}
+  int i = 0;
+  while (i < fileStreams.count() && fileStreams[i].next != offset)
+    ++i;
 
-void
-FileStore::MapBlock(QByteArray hash,
-		    const char *data,
-		    int size,
-		    const QString& fileName,
-		    quint32 level)
-{
-  QByteArray block(data, size);
-  QFileInfo fileInfo(fileName);
-  QMap<QString, QVariant> val;  
-  
-  val["fullname"] = fileName;
-  val["filename"] = fileInfo.fileName();
-  val["block"] = block;  
-  val["level"] = level;  
-  blockMap[hash] = val;  
+  // The most recently used stream is kept first, a new reader
+  // takes the place of the one left alone the longest.
+  if (i < fileStreams.count())
+    fileStreams.move(i, 0);
+  else {
+    if (fileStreams.count() >= READAHEAD_STREAMS)
+      fileStreams.removeLast();
+    fileStreams.prepend(ReadStream());
+  }
+
+  ReadStream& stream = fileStreams[0];
+  if (offset == stream.next)
+    ++stream.run;
+  stream.next = offset + length;
+
+  if (stream.run < READAHEAD_RUN || stream.next + READAHEAD_SIZE / 2 < stream.advised)
+    return;
+
+  // Only ask for what wasn't asked for already.
+  qint64 from = qMax(stream.next, stream.advised);
+  qint64 to = stream.next + READAHEAD_SIZE;
+  ::posix_fadvise(fd, from, to - from, POSIX_FADV_WILLNEED);
+  stream.advised = to;
 }
 
 
 
+/*
+ * Look the query up in the keyword index, answering with at
+ * most maxResults files.
+ */
 bool
-FileStore::Search(const QString& query, QMap<QString, QVariant> *ret)
+FileStore::Search(const QString& query, int maxResults, QMap<QString, QVariant> *ret)
 {
   qDebug() << "FileStore: got search request for " << query;
-  bool isPresent = false;
-  QList<QString> keys = fileMeta.keys();
+  QList<quint32> matches = searchIndex.Query(query, maxResults);
   
   QList<QString> retFiles;
   QList<QByteArray> retBlocks;
 
-  for(int i = 0; i < keys.count(); ++i){
+  for(int i = 0; i < matches.count(); ++i){
     
-    if(Match(query, keys[i])){
-      isPresent = true;
-      QList<QMap<QString, QVariant> > vals = fileMeta.values(keys[i]);
-      
-      qDebug() << "FileStore: found something";
-      
-      for(int j = 0; j < vals.count(); ++j){
-	
-	retFiles.append(keys[i]);
-	retBlocks.append(vals[j]["block"].toByteArray());
-      }
-    }
-      
+    retFiles.append(fileNames[matches[i]]);
+    retBlocks.append(blocks.Hash(fileMeta[matches[i]].master));
   }
   
   (*ret)["MatchNames"] = ConvertStrings(retFiles);
   (*ret)["MatchIDs"] = ConvertBytes(retBlocks);
   (*ret)["SearchReply"] = query;
 
-  return isPresent;
+  return !matches.isEmpty();
 }
 
+/*
+ * Look a block up and read it for BlockServer's threads: safe to
+ * call from any thread, and blocking. The index is looked up under
+ * the read lock, which is dropped before going to the disk.
+ */
 bool
-FileStore::Match(const QString& query, const QString& key)
+FileStore::ServeBlock(const QByteArray& index, QByteArray *data, bool *chunkList, int *level)
 {
-  QStringList keyWords = query.split(" ", QString::SkipEmptyParts);
-  
-  for(int i = 0; i < keyWords.count(); ++i)
-    if (key.contains(keyWords[i]))
+  quint32 slot;
+  quint32 length;
+  QList<quint32> files;
+  QList<qint64> offsets;
+  QStringList paths;
+  {
+    QReadLocker locker(&indexLock);
+    slot = blocks.Find(index);
+    if (slot == NO_SLOT)
+      return false;
+
+    *chunkList = chunkLists.contains(slot);
+    *level = blocks.Level(slot);
+    if (metaBlocks.contains(slot)){
+      *data = metaBlocks.value(slot);
       return true;
+    }
+
+    QMutexLocker cacheLocker(&cacheLock);
+    if (cache.Find(slot, data))
+      return true;
+    cacheLocker.unlock();
+
+    length = blocks.Length(slot);
+    for(quint32 loc = blocks.FirstLocation(slot); loc != NO_LOCATION; loc = blocks.NextLocation(loc)){
+
+      files.append(blocks.LocationFile(loc));
+      offsets.append(blocks.LocationOffset(loc));
+      paths.append(filePaths.at(blocks.LocationFile(loc)));
+    }
+  }
+
+  for(int i = 0; i < files.count(); ++i){
+
+    QByteArray block;
+    if (!WorkerRead(files[i], paths[i], offsets[i], length, &block))
+      continue;
+
+    // Changed on disk, or replaced under our descriptor.
+    if (FileIndexer::Hash(block) != index){
+
+      qDebug() << "File store: block changed on disk, not serving it";
+      WorkerClose(paths[i]);
+      continue;
+    }
 
+    // The slot may have been dropped and reused meanwhile.
+    QReadLocker locker(&indexLock);
+    if (blocks.Find(index) == slot){
 
+      QMutexLocker cacheLocker(&cacheLock);
+      cache.Insert(slot, block);
+    }
+    *data = block;
+    return true;
+  }
   return false;
 }
 
+// Read from a file through this thread's own descriptors.
 bool
-FileStore::ReturnBlock(QByteArray index, QByteArray *ptr, QByteArray *indexPtr)
+FileStore::WorkerRead(quint32 fileId, const QString& path, qint64 offset, quint32 length, QByteArray *data)
 {
-  if (!blockMap.contains(index)){
-    return false;
+  if (!workerFiles.hasLocalData())
+    workerFiles.setLocalData(new WorkerFiles);
+  QHash<QString, int>& fds = workerFiles.localData()->fds;
+
+  int fd = fds.value(path, -1);
+  if (fd < 0){
+
+    if (fds.count() >= WORKER_OPEN_FILES){
+
+      QHash<QString, int>::iterator victim = fds.begin();
+      ::close(victim.value());
+      fds.erase(victim);
+    }
+
+    fd = ::open(path.toLocal8Bit().constData(), O_RDONLY);
+    if (fd < 0){
+
+      qDebug() << "File store: couldn't open " << path;
+      return false;
+    }
+    fds[path] = fd;
   }
-  else{
-    
-    QMap<QString, QVariant> value = blockMap[index];
-    *ptr = value["block"].toByteArray();
-    *indexPtr = index;
-    return true;
+
+  QByteArray block(length, 0);
+  if (::pread(fd, block.data(), length, offset) != (ssize_t)length){
+
+    qDebug() << "File store: short read from " << path;
+    return false;
   }
+
+  ReadAhead(fileId, fd, offset, length);
+  *data = block;
+  return true;
 }
 
+void
+FileStore::WorkerClose(const QString& path)
+{
+  if (!workerFiles.hasLocalData())
+    return;
+
+  QHash<QString, int>& fds = workerFiles.localData()->fds;
+  if (fds.contains(path))
+    ::close(fds.take(path));
+}
 
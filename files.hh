@@ -2,6 +2,11 @@
 #define FILES_HH
 
 #include <fileconstants.hh>
+#include <indexer.hh>
+#include <searchindex.hh>
+#include <blockindex.hh>
+#include <blockcache.hh>
+#include <walker.hh>
 
 #include <QObject>
 #include <QString>
@@ -13,7 +18,56 @@
 #include <QVariant>
 #include <QVariantMap>
 #include <QMap>
+#include <QHash>
 #include <QUuid>
+#include <QSet>
+#include <QVector>
+#include <QTimer>
+#include <QFileSystemWatcher>
+#include <QReadWriteLock>
+#include <QMutex>
+#include <QThreadStorage>
+
+// A published file: the slot of its master block in the block
+// index, and the level of the tree below it. The path and name
+// come from the interned FileStore::filePaths.
+struct SharedFile
+{
+  SharedFile() : master(NO_SLOT), level(0) {}
+
+  quint32 master;
+  quint32 level;
+};
+
+// Descriptors a serving thread keeps open, by path. Closed when
+// the thread exits.
+struct WorkerFiles
+{
+  ~WorkerFiles();
+
+  QHash<QString, int> fds;
+};
+
+// How a shared file is being read by the block server. Peers
+// downloading it ask for its blocks in (nearly) file order.
+struct ReadStream
+{
+  ReadStream() : next(-1), advised(0), run(0) {}
+
+  qint64 next;      // Offset just past the last block read
+  qint64 advised;   // End of what the kernel was told to read ahead
+  int run;          // Sequential reads in a row
+};
+
+// A directory tree shared as a whole, walked again at startup and
+// when it changes. Its files are named relative to the directory's
+// parent, and it gets a manifest listing them.
+struct SharedDirectory
+{
+  QString path;
+  QStringList includes;
+  QStringList excludes;
+};
 
 class FileStore : public QObject
 {
@@ -24,18 +78,57 @@ public:
   FileStore();
 
   bool
-  Search(const QString& query, QMap<QString, QVariant> *ret);
+  Search(const QString& query, int maxResults, QMap<QString, QVariant> *ret);
+
+  bool
+  ServeBlock(const QByteArray& index, QByteArray *data, bool *chunkList, int *level);
+
+  void
+  LoadIndex(const QString& fileName);
+
+  void
+  UnshareFile(const QString& fileName);
+
+  void
+  SetChunking(bool chunked);
 
   bool
-  ReturnBlock(QByteArray index, QByteArray *ptr, QByteArray *indexPtr);    
+  ListEntries(const QByteArray& list, int start, int count, QList<QByteArray> *hashes);
 
 	  
 public slots:
 
   void
   IndexFiles(const QStringList & files);
+
+  void
+  ShareDirectory(const QString& dirName, const QStringList& includes, const QStringList& excludes);
+
+  void
+  FeedIndexer();
   
+  void
+  CancelIndexing();
+
+  void
+  CommitFile(const IndexedFile& file);
+
+  void
+  FileChanged(const QString& fileName);
+
+  void
+  DirectoryChanged(const QString& dirName);
+
+  void
+  ReindexChanged();
+
+  void
+  AddWatches();
   
+signals:
+
+  void
+  indexProgress(const QString& fileName, qint64 done, qint64 total);
 
 private:
   
@@ -46,39 +139,126 @@ private:
   QList<QVariant>
   ConvertStrings(const QList<QString>&strings);
 
-  
+
+  quint32
+  ConvertHash(const QByteArray& arr);
+
   void
-  IndexSingleFile(const QString& file);
-  
-  
+  PublishFile(const IndexedFile& file);
+
   void
-  HashBlocks(QDataStream& s, const QString& fileName, quint32 level);
+  AppendIndex(const IndexedFile& file);
 
-  
-  QByteArray
-  Hash(const char *data, int size);
+  void
+  WriteIndex(const QList<IndexedFile>& files);
+
+  void
+  MapBlock(const IndexedBlock& block, quint32 fileId, bool chunked);
+
+  void
+  UnmapBlock(quint32 slot, quint32 fileId);
+
+  void
+  UnpublishFile(quint32 fileId);
 
   quint32
-  ConvertHash(const QByteArray& arr);
+  FileId(const QString& fileName);
+
+  void
+  WalkChanged();
 
   void
-  MapBlock(QByteArray hash,
-	   const char *data,
-	   int size,
-	   const QString& fileName,
-	   quint32 level);
+  Watch(const QString& fileName);
 
+  void
+  Unwatch(const QString& fileName);
 
   void
-  MapMaster(QByteArray hash,
-	    quint32 level,
-	    const QString& fileName);
+  ReadAhead(quint32 fileId, int fd, qint64 offset, quint32 length);
 
   bool
-  Match(const QString &query, const QString &key);
+  WorkerRead(quint32 fileId, const QString& path, qint64 offset, quint32 length, QByteArray *data);
+
+  void
+  WorkerClose(const QString& path);
+
+
+  void
+  MapMaster(const QByteArray& hash,
+	    quint32 level,
+	    quint32 fileId,
+	    const QString& name);
+
+  QString
+  DisplayName(const QString& fileName);
+
+  int
+  SharedRoot(const QString& fileName);
+
+  void
+  UpdateDirectories();
+
+  void
+  PublishManifest(const SharedDirectory& dir);
+
+  void
+  LoadDirectories();
+
+  void
+  SaveDirectories();
   
-  QHash<QByteArray, QMap<QString, QVariant> > blockMap;
-  QHash<QString, QMap<QString, QVariant> > fileMeta;
+  FileIndexer indexer;
+
+  // Data blocks are read from their file on demand, only the
+  // (much smaller) meta-list blocks are kept in memory. Both are
+  // keyed by their slot in the block index.
+  BlockIndex blocks;
+  QHash<quint32, QByteArray> metaBlocks;
+  QSet<quint32> chunkLists;
+  QHash<quint32, QVector<quint32> > fileBlocks;
+  QHash<quint32, SharedFile> fileMeta;
+  QHash<quint32, QString> fileNames;
+  SearchIndex searchIndex;
+
+  // Shared trees are walked on DirectoryWalker's threads, FileStore
+  // takes the files it finds as the indexer catches up.
+  DirectoryWalker walker;
+  QList<SharedDirectory> sharedDirs;
+  bool directoriesDirty;
+
+  QList<QString> filePaths;
+  QHash<QString, quint32> fileIds;
+
+  // Data blocks recently served, and per file read patterns.
+  BlockCache cache;
+  QHash<quint32, QList<ReadStream> > streams;
+
+  // Blocks are also served from BlockServer's threads. Only the
+  // event loop changes the index (blocks, metaBlocks, chunkLists,
+  // filePaths), under the write lock; the serving threads read it
+  // under the read lock. The cache and read streams change on
+  // every read, they have locks of their own.
+  QReadWriteLock indexLock;
+  QMutex cacheLock;
+  QMutex streamLock;
+  QThreadStorage<WorkerFiles *> workerFiles;
+
+  // The on-disk index is a log of IndexedFile records, the last
+  // record for a path wins. It is compacted on every load.
+  QString indexFile;
+  QHash<QString, FileSignature> fileSignatures;
+
+  // Shared files are watched (inotify on Linux), along with the
+  // directories holding them. Changes are collected until things
+  // have been quiet for REINDEX_DELAY, then rehashed in one go.
+  QFileSystemWatcher watcher;
+  QSet<QString> watchedFiles;
+  QHash<QString, QSet<QString> > watchedDirs;
+  QSet<QString> newWatches;     // Not handed to the watcher yet
+  QTimer watchTimer;
+  QSet<QString> pendingChanges;
+  QSet<QString> changedDirs;
+  QTimer reindexTimer;
 
 };
 
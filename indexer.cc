@@ -0,0 +1,550 @@
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <QDebug>
+#include <QFuture>
+#include <QtConcurrentMap>
+#include <QThreadStorage>
+#include <QVector>
+
+#include <indexer.hh>
+#include <sha256.hh>
+#include <diskio.hh>
+
+// Each reader thread keeps its own ring, a ring is single threaded.
+static QThreadStorage<IoRing *> readerRings;
+
+/*
+ * The block layout is the same one FileStore always used: a file
+ * is cut in BLOCK_SIZE blocks, the last one possibly short (or
+ * even empty). The concatenated hashes of one level form the
+ * meta-list, which is cut and hashed the same way one level up,
+ * until it fits in a single block: the master block.
+ */
+
+/*
+ * The Gear table must be the same on every node, or the same file
+ * would be cut differently. Fill it from a fixed splitmix64 seed.
+ */
+static quint64 GEAR[256];
+
+static bool
+FillGear()
+{
+  quint64 x = 0x5045455253544552ULL;
+  for(int i = 0; i < 256; ++i){
+
+    quint64 z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    GEAR[i] = z ^ (z >> 31);
+  }
+  return true;
+}
+
+static const bool GEAR_FILLED = FillGear();
+
+// Normalized chunking: a harder mask before CDC_AVG_SIZE
+// (2^13) and an easier one after it, in the top bits.
+#define CDC_MASK_SMALL (0x7fffULL << 49)   // 15 bits
+#define CDC_MASK_LARGE (0x7ffULL << 53)    // 11 bits
+
+IndexJob::IndexJob(FileIndexer *indexer, const QString& fileName, int generation, bool chunked)
+{
+  m_indexer = indexer;
+  m_fileName = fileName;
+  m_generation = generation;
+  m_chunked = chunked;
+  m_started = false;
+  m_offset = 0;
+  m_failed = false;
+}
+
+void
+IndexJob::run()
+{
+  if (m_indexer->Cancelled(m_generation)){
+    m_indexer->JobDone();
+    return;
+  }
+
+  QFile file(m_fileName);
+  if (!file.open(QIODevice::ReadOnly)){
+
+    qDebug() << "File indexer: file " << m_fileName << " not found.";
+    m_indexer->JobDone();
+    return;
+  }
+
+  IndexedFile result;
+  result.fileName = m_fileName;
+  result.chunked = m_chunked;
+  if (!FileIndexer::Signature(m_fileName, &result.signature)){
+    m_indexer->JobDone();
+    return;
+  }
+
+  qint64 total = file.size();
+  qint64 done = 0;
+  QByteArray hashes;
+
+  bool atEnd = false;
+  QList<QByteArray> batch = ReadBatch(&file, &atEnd);
+
+  while (!batch.isEmpty()){
+
+    // Each hashing task takes SHA256_LANES blocks, so the
+    // multi-buffer engine can hash them together.
+    QList<QList<QByteArray> > groups;
+    for(int i = 0; i < batch.count(); i += SHA256_LANES)
+      groups.append(batch.mid(i, SHA256_LANES));
+
+    QFuture<QList<QByteArray> > hashing = QtConcurrent::mapped(groups, Sha256::HashMany);
+
+    // Read the next batch while this one is being hashed.
+    QList<QByteArray> next;
+    if (!atEnd)
+      next = ReadBatch(&file, &atEnd);
+
+    hashing.waitForFinished();
+
+    for(int i = 0; i < batch.count(); ++i){
+
+      IndexedBlock block;
+      block.hash = hashing.resultAt(i / SHA256_LANES)[i % SHA256_LANES];
+      block.offset = done;
+      block.length = batch[i].size();
+      block.level = 0;
+
+      result.blocks.append(block);
+      hashes += ListEntry(block.hash, block.length, m_chunked);
+      done += batch[i].size();
+    }
+
+    if (m_indexer->Cancelled(m_generation)){
+
+      qDebug() << "File indexer: cancelled " << m_fileName;
+      m_indexer->JobDone();
+      return;
+    }
+
+    m_indexer->Progress(m_fileName, done, total);
+    batch = next;
+  }
+
+  // A read error would look like the end of the file: don't share
+  // a truncated index of it.
+  if (m_failed){
+
+    qDebug() << "File indexer: couldn't read all of " << m_fileName << ", not sharing it";
+    m_indexer->JobDone();
+    return;
+  }
+
+  HashMetaLevels(hashes, m_chunked, &result);
+  qDebug() << "Hashed " << m_fileName << ", " << result.blocks.count() << " blocks";
+
+  if (!m_indexer->Cancelled(m_generation))
+    m_indexer->Publish(result);
+  m_indexer->JobDone();
+}
+
+// Read up to INDEX_BATCH blocks, stopping after the first short one.
+QList<QByteArray>
+IndexJob::ReadBatch(QFile *file, bool *atEnd)
+{
+  if (m_chunked)
+    return ReadChunks(file, atEnd);
+
+  QList<QByteArray> batch = ReadBlocks(file, INDEX_BATCH);
+  if (m_failed || batch.last().size() < BLOCK_SIZE)
+    *atEnd = true;
+  return batch;
+}
+
+/*
+ * Read the next count blocks, stopping after the first short (or
+ * empty) one.
+ * With io_uring they are all queued at once, so the device sees a
+ * deep queue instead of one read at a time. A short read is only
+ * the end of the file once reading the rest returns nothing; an
+ * error sets m_failed.
+ */
+QList<QByteArray>
+IndexJob::ReadBlocks(QFile *file, int count)
+{
+  QList<QByteArray> blocks;
+
+  // A ring that failed to open stays around, closed, so we only try once.
+  if (!readerRings.hasLocalData()){
+    IoRing *ring = new IoRing();
+    ring->Open(INDEX_BATCH);
+    readerRings.setLocalData(ring);
+  }
+  IoRing *ring = readerRings.localData();
+
+  if (!ring->IsOpen()){
+
+    for(int i = 0; i < count; ++i){
+
+      QByteArray block = file->read(BLOCK_SIZE);
+      if (block.size() < BLOCK_SIZE && file->error() != QFile::NoError){
+
+	qDebug() << "File indexer: couldn't read " << m_fileName << ": " << file->errorString();
+	m_failed = true;
+	break;
+      }
+      blocks.append(block);
+      m_offset += block.size();
+
+      if (block.size() < BLOCK_SIZE)
+	break;
+    }
+    return blocks;
+  }
+
+  QList<QByteArray> buffers;
+  int queued = 0;
+  for(int i = 0; i < count; ++i){
+
+    buffers.append(QByteArray(BLOCK_SIZE, 0));
+    if (ring->PrepareRead(file->handle(), buffers[i].data(), BLOCK_SIZE,
+			  m_offset + (qint64)i * BLOCK_SIZE, i))
+      ++queued;
+  }
+  ring->Submit(queued);
+
+  QVector<int> results(count, 0);
+  for(int done = 0; done < queued; ){
+
+    quint64 tag;
+    int result;
+    if (ring->Reap(&tag, &result)){
+      results[tag] = result;
+      ++done;
+    }
+    else
+      ring->Submit(1);
+  }
+
+  // Blocks the ring had no room for come back empty, and are read
+  // here like the rest of a short one.
+  for(int i = 0; i < count; ++i){
+
+    int size = results[i];
+    while (size >= 0 && size < BLOCK_SIZE){
+
+      ssize_t more = ::pread(file->handle(), buffers[i].data() + size, BLOCK_SIZE - size, m_offset + size);
+      if (more < 0 && errno == EINTR)
+	continue;
+      if (more <= 0){
+	if (more < 0)
+	  size = -errno;
+	break;
+      }
+      size += more;
+    }
+
+    if (size < 0){
+
+      qDebug() << "File indexer: couldn't read " << m_fileName << ": " << strerror(-size);
+      m_failed = true;
+      break;
+    }
+    blocks.append(buffers[i].left(size));
+    m_offset += size;
+    if (size < BLOCK_SIZE)
+      break;
+  }
+  return blocks;
+}
+
+/*
+ * Read about INDEX_BATCH blocks worth of data and cut it into
+ * chunks. Bytes after the last boundary are kept for the next
+ * call, at the end of the file they form the last chunk. An
+ * empty file still gets one (empty) chunk.
+ */
+QList<QByteArray>
+IndexJob::ReadChunks(QFile *file, bool *atEnd)
+{
+  QList<QByteArray> batch;
+
+  qint64 wanted = (qint64)INDEX_BATCH * BLOCK_SIZE;
+  QByteArray more;
+  QList<QByteArray> blocks = ReadBlocks(file, INDEX_BATCH);
+  for(int i = 0; i < blocks.count(); ++i)
+    more += blocks[i];
+
+  QByteArray data = m_carry + more;
+  bool eof = more.size() < wanted;
+
+  int pos = 0;
+  while (pos < data.size()){
+
+    int cut = ChunkBoundary(data.constData() + pos, data.size() - pos);
+
+    // No boundary in what we have yet, wait for more data.
+    if (!eof && pos + cut == data.size() && cut < CDC_MAX_SIZE)
+      break;
+
+    batch.append(data.mid(pos, cut));
+    pos += cut;
+  }
+  m_carry = data.mid(pos);
+
+  if (eof){
+    *atEnd = true;
+    if (!m_started && batch.isEmpty())
+      batch.append(QByteArray());
+  }
+  m_started = true;
+  return batch;
+}
+
+// Length of the chunk starting at data.
+int
+IndexJob::ChunkBoundary(const char *data, int size)
+{
+  if (size <= CDC_MIN_SIZE)
+    return size;
+
+  int normal = qMin(size, CDC_AVG_SIZE);
+  int max = qMin(size, CDC_MAX_SIZE);
+  quint64 hash = 0;
+
+  int i = CDC_MIN_SIZE;
+  for(; i < normal; ++i){
+    hash = (hash << 1) + GEAR[(unsigned char)data[i]];
+    if (!(hash & CDC_MASK_SMALL))
+      return i + 1;
+  }
+  for(; i < max; ++i){
+    hash = (hash << 1) + GEAR[(unsigned char)data[i]];
+    if (!(hash & CDC_MASK_LARGE))
+      return i + 1;
+  }
+  return max;
+}
+
+// A meta-list entry: the hash, followed by the length in chunked mode.
+QByteArray
+IndexJob::ListEntry(const QByteArray& hash, quint32 length, bool chunked)
+{
+  if (!chunked)
+    return hash;
+
+  QByteArray entry = hash;
+  entry.append((char)(length >> 24));
+  entry.append((char)(length >> 16));
+  entry.append((char)(length >> 8));
+  entry.append((char)length);
+  return entry;
+}
+
+// Build the meta-list levels above the data blocks, ending
+// with the master block.
+void
+IndexJob::HashMetaLevels(QByteArray hashes, bool chunked, IndexedFile *result)
+{
+  quint32 level = 0;
+
+  // Chunked lists are cut on entry boundaries, so a meta block
+  // never splits a hash from its length.
+  int entrySize = chunked ? HASH_SIZE + 4 : HASH_SIZE;
+  int listSize = BLOCK_SIZE / entrySize * entrySize;
+
+  while (hashes.size() > listSize){
+
+    ++level;
+    QByteArray upper;
+
+    for(int offset = 0; ; offset += listSize){
+
+      IndexedBlock block;
+      block.data = hashes.mid(offset, listSize);
+      block.hash = FileIndexer::Hash(block.data);
+      block.offset = 0;
+      block.length = block.data.size();
+      block.level = level;
+
+      result->blocks.append(block);
+      upper += ListEntry(block.hash, block.length, chunked);
+
+      if (block.data.size() < listSize)
+	break;
+    }
+    hashes = upper;
+  }
+
+  IndexedBlock master;
+  master.data = hashes;
+  master.hash = FileIndexer::Hash(hashes);
+  master.offset = 0;
+  master.length = hashes.size();
+  master.level = level + 1;
+
+  result->blocks.append(master);
+  result->master = master.hash;
+  result->level = master.level;
+}
+
+
+
+FileIndexer::FileIndexer()
+{
+  qRegisterMetaType<IndexedFile>("IndexedFile");
+  readers.setMaxThreadCount(INDEX_READERS);
+  chunking = false;
+  qDebug() << "File indexer: hashing with " << Sha256::Engine();
+}
+
+FileIndexer::~FileIndexer()
+{
+  CancelIndexing();
+  readers.waitForDone();
+}
+
+QByteArray
+FileIndexer::Hash(const QByteArray& block)
+{
+  return Sha256::Hash(block);
+}
+
+bool
+FileIndexer::Signature(const QString& fileName, FileSignature *signature)
+{
+  struct stat st;
+  if (::stat(fileName.toLocal8Bit().constData(), &st) != 0)
+    return false;
+
+  signature->size = st.st_size;
+  signature->mtime = (qint64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  signature->inode = st.st_ino;
+  return true;
+}
+
+/*
+ * Queue the files on the reader pool and return right away,
+ * each file is handed back through fileIndexed() once hashed.
+ */
+void
+FileIndexer::IndexFiles(const QStringList& files)
+{
+  for(int i = 0; i < files.count(); ++i){
+
+    activeJobs.ref();
+    readers.start(new IndexJob(this, files[i], generation, chunking));
+  }
+}
+
+// Cut the files indexed from now on at content-defined boundaries.
+void
+FileIndexer::SetChunking(bool chunked)
+{
+  chunking = chunked;
+}
+
+bool
+FileIndexer::Chunking()
+{
+  return chunking;
+}
+
+int
+FileIndexer::Pending()
+{
+  return activeJobs;
+}
+
+// Drop every queued and running job, nothing they hashed is published.
+void
+FileIndexer::CancelIndexing()
+{
+  generation.ref();
+}
+
+bool
+FileIndexer::Cancelled(int jobGeneration)
+{
+  return generation != jobGeneration;
+}
+
+void
+FileIndexer::Publish(const IndexedFile& file)
+{
+  emit fileIndexed(file);
+}
+
+void
+FileIndexer::Progress(const QString& fileName, qint64 done, qint64 total)
+{
+  emit indexProgress(fileName, done, total);
+}
+
+void
+FileIndexer::JobDone()
+{
+  if (!activeJobs.deref())
+    emit indexingFinished();
+}
+
+
+
+bool
+FileSignature::operator== (const FileSignature& other) const
+{
+  return size == other.size && mtime == other.mtime && inode == other.inode;
+}
+
+QDataStream &
+operator<< (QDataStream &out, const IndexedBlock &block)
+{
+  out << block.hash << block.offset << block.length << block.level;
+
+  // Data blocks are read back from the file, only meta-lists are stored.
+  if (block.level > 0)
+    out << block.data;
+  return out;
+}
+
+QDataStream &
+operator>> (QDataStream &in, IndexedBlock &block)
+{
+  in >> block.hash >> block.offset >> block.length >> block.level;
+
+  block.data.clear();
+  if (block.level > 0)
+    in >> block.data;
+  return in;
+}
+
+QDataStream &
+operator<< (QDataStream &out, const FileSignature &signature)
+{
+  out << signature.size << signature.mtime << signature.inode;
+  return out;
+}
+
+QDataStream &
+operator>> (QDataStream &in, FileSignature &signature)
+{
+  in >> signature.size >> signature.mtime >> signature.inode;
+  return in;
+}
+
+QDataStream &
+operator<< (QDataStream &out, const IndexedFile &file)
+{
+  out << file.fileName << file.signature << file.chunked << file.blocks << file.master << file.level;
+  return out;
+}
+
+QDataStream &
+operator>> (QDataStream &in, IndexedFile &file)
+{
+  in >> file.fileName >> file.signature >> file.chunked >> file.blocks >> file.master >> file.level;
+  return in;
+}
@@ -0,0 +1,194 @@
+#ifndef INDEXER_HH
+#define INDEXER_HH
+
+#include <fileconstants.hh>
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <QByteArray>
+#include <QMetaType>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QAtomicInt>
+#include <QFile>
+#include <QDataStream>
+
+class FileIndexer;
+
+// One block of an indexed file. Data blocks (level 0) only record
+// where they live in the file, meta-list blocks carry their data.
+struct IndexedBlock
+{
+  QByteArray hash;
+  QByteArray data;
+  qint64 offset;
+  quint32 length;
+  quint32 level;
+};
+
+// What a file looked like when we hashed it. If any of these
+// change, the file has to be hashed again.
+struct FileSignature
+{
+  FileSignature() : size(0), mtime(0), inode(0) {}
+
+  qint64 size;
+  qint64 mtime;     // nanoseconds
+  quint64 inode;
+
+  bool
+  operator== (const FileSignature& other) const;
+};
+
+// Everything FileStore needs to publish a file: all of its
+// blocks and the master block at the top of the tree.
+//
+// A chunked file was cut at content-defined boundaries, its
+// meta-lists hold a 4-byte big-endian length after every hash.
+struct IndexedFile
+{
+  QString fileName;
+  FileSignature signature;
+  bool chunked;
+  QList<IndexedBlock> blocks;
+  QByteArray master;
+  quint32 level;
+};
+Q_DECLARE_METATYPE(IndexedFile);
+
+QDataStream &
+operator<< (QDataStream &out, const IndexedBlock &block);
+QDataStream &
+operator>> (QDataStream &in, IndexedBlock &block);
+QDataStream &
+operator<< (QDataStream &out, const FileSignature &signature);
+QDataStream &
+operator>> (QDataStream &in, FileSignature &signature);
+QDataStream &
+operator<< (QDataStream &out, const IndexedFile &file);
+QDataStream &
+operator>> (QDataStream &in, IndexedFile &file);
+
+/*
+ * Hashes a single file on a reader thread. Blocks are read in
+ * batches, and each batch is hashed on the global thread pool
+ * while the next one is being read. Where io_uring is available
+ * a whole batch of reads is in flight at once.
+ *
+ * In chunked mode blocks are cut where a Gear rolling hash hits
+ * a mask (FastCDC with normalized chunking), between CDC_MIN_SIZE
+ * and CDC_MAX_SIZE bytes, so an insertion only changes the chunks
+ * around it.
+ */
+class IndexJob : public QRunnable
+{
+public:
+  IndexJob(FileIndexer *indexer, const QString& fileName, int generation, bool chunked);
+
+  void
+  run();
+
+  static int
+  ChunkBoundary(const char *data, int size);
+
+  static QByteArray
+  ListEntry(const QByteArray& hash, quint32 length, bool chunked);
+
+  static void
+  HashMetaLevels(QByteArray hashes, bool chunked, IndexedFile *result);
+
+private:
+
+  QList<QByteArray>
+  ReadBatch(QFile *file, bool *atEnd);
+
+  QList<QByteArray>
+  ReadChunks(QFile *file, bool *atEnd);
+
+  QList<QByteArray>
+  ReadBlocks(QFile *file, int count);
+
+  FileIndexer *m_indexer;
+  QString m_fileName;
+  int m_generation;
+  bool m_chunked;
+  bool m_started;
+  qint64 m_offset;
+  QByteArray m_carry;
+  bool m_failed;            // A read failed, the file isn't published
+};
+
+/*
+ * Runs the indexing pipeline off the event loop:
+ *
+ *   readers (INDEX_READERS files at a time)
+ *     -> hashing pool (one task per SHA256_LANES blocks)
+ *       -> fileIndexed(), delivered to the event loop once per file.
+ */
+class FileIndexer : public QObject
+{
+  Q_OBJECT
+
+public:
+  FileIndexer();
+  ~FileIndexer();
+
+  static QByteArray
+  Hash(const QByteArray& block);
+
+  static bool
+  Signature(const QString& fileName, FileSignature *signature);
+
+  // Called from the jobs, on the reader threads.
+  bool
+  Cancelled(int generation);
+
+  void
+  Publish(const IndexedFile& file);
+
+  void
+  Progress(const QString& fileName, qint64 done, qint64 total);
+
+  void
+  JobDone();
+
+  void
+  SetChunking(bool chunked);
+
+  bool
+  Chunking();
+
+  // Files queued or being hashed.
+  int
+  Pending();
+
+public slots:
+
+  void
+  IndexFiles(const QStringList& files);
+
+  void
+  CancelIndexing();
+
+signals:
+
+  void
+  fileIndexed(const IndexedFile& file);
+
+  void
+  indexProgress(const QString& fileName, qint64 done, qint64 total);
+
+  void
+  indexingFinished();
+
+private:
+
+  QThreadPool readers;
+  bool chunking;
+  QAtomicInt generation;
+  QAtomicInt activeJobs;
+};
+
+#endif // INDEXER_HH
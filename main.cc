@@ -14,6 +14,8 @@
 #include <QListWidget>
 #include <QtCrypto>
 #include <QLabel>
+#include <QFile>
+#include <QFileInfo>
 
 #include "main.hh"
 #include "router.hh"
@@ -90,9 +92,28 @@ FileDialog::FileDialog(FileRequests *fr)
   fileButton = new QPushButton("Share File ...", this);
   fileButton->setDown(false);
   fileButton->setChecked(false);
+
+  // Whole trees, filtered by space separated wildcards.
+  dirButton = new QPushButton("Share Directory ...", this);
+  includeEdit = new QLineEdit(this);
+  excludeEdit = new QLineEdit(".* *~ *.o", this);
+  QHBoxLayout *patternLayout = new QHBoxLayout();
+  patternLayout->addWidget(new QLabel("Include:"));
+  patternLayout->addWidget(includeEdit);
+  patternLayout->addWidget(new QLabel("Exclude:"));
+  patternLayout->addWidget(excludeEdit);
+
+  // Files are hashed in the background, show how far along we are.
+  indexStatus = new QLabel("", this);
+  cancelButton = new QPushButton("Cancel indexing", this);
+  cancelButton->setEnabled(false);
   
   layout->addLayout(innerLayout);
   layout->addWidget(fileButton);
+  layout->addWidget(dirButton);
+  layout->addLayout(patternLayout);
+  layout->addWidget(indexStatus);
+  layout->addWidget(cancelButton);
   setLayout(layout);
   
   connect(text, SIGNAL(returnPressed()),
@@ -109,6 +130,28 @@ FileDialog::FileDialog(FileRequests *fr)
 
   connect(fileButton, SIGNAL(pressed()),
 	  this, SLOT(fileButtonClicked()));		       
+
+  connect(dirButton, SIGNAL(clicked()),
+	  this, SLOT(dirButtonClicked()));
+
+  connect(cancelButton, SIGNAL(clicked()),
+	  this, SIGNAL(cancelIndexing()));
+}
+
+void
+FileDialog::indexProgress(const QString& fileName, qint64 done, qint64 total)
+{
+  QFileInfo fileInfo(fileName);
+  int percent = (total > 0) ? (int)((done * 100) / total) : 100;
+
+  if (percent < 100){
+    indexStatus->setText("Indexing " + fileInfo.fileName() + ": " + QString::number(percent) + "%");
+    cancelButton->setEnabled(true);
+  }
+  else{
+    indexStatus->setText("Indexed " + fileInfo.fileName());
+    cancelButton->setEnabled(false);
+  }
 }
 
 
@@ -146,6 +189,18 @@ FileDialog::filesSelected(const QStringList & files)
   emit indexFiles(files);
 }
 
+void
+FileDialog::dirButtonClicked()
+{
+  QString dirName = QFileDialog::getExistingDirectory(this, "Share Directory");
+  if (dirName.isEmpty())
+    return;
+
+  QStringList includes = includeEdit->text().split(" ", QString::SkipEmptyParts);
+  QStringList excludes = excludeEdit->text().split(" ", QString::SkipEmptyParts);
+  emit shareDirectory(dirName, includes, excludes);
+}
+
 
 void
 FileDialog::newSearch()
@@ -498,17 +553,12 @@ ChatDialog::openEmptyPrivateChat(QListWidgetItem* item)
 
 //Begin: NetSocket
 
-NetSocket::NetSocket()
+NetSocket::NetSocket(const NodeConfig &given_config)
 {
-	// Pick a range of four UDP ports to try to allocate by default,
-	// computed based on my Unix user ID.
-	// This makes it trivial for up to four Peerster instances per user
-	// to find each other on the same host,
-	// barring UDP port conflicts with other applications
-	// (which are quite possible).
-	// We use the range from 32768 to 49151 for this purpose.
-	myPortMin = 32768 + (getuid() % 4096)*4;
-	myPortMax = myPortMin + 3;
+	config = given_config;
+	myPortMin = config.portMin;
+	myPortMax = config.portMax;
+	noForward = config.noForward;
 	
 
 
@@ -516,9 +566,14 @@ NetSocket::NetSocket()
 	messageIdCounter = 1;
 	
 
+	QObject::connect(&fs, SIGNAL(indexProgress(const QString&, qint64, qint64)),
+			 this, SIGNAL(indexProgress(const QString&, qint64, qint64)));
+
 	dispatcher = new Dispatcher(&fs, this);
-	QObject::connect(this, SIGNAL(toDispatcher(const QMap<QString, QVariant>&)),
-			 dispatcher, SLOT(processRequest(const QMap<QString, QVariant>&)));
+	QObject::connect(this, SIGNAL(toDispatcher(const QMap<QString, QVariant>&, const QHostAddress&, quint16)),
+			 dispatcher, SLOT(processSearch(const QMap<QString, QVariant>&, const QHostAddress&, quint16)));
+	QObject::connect(this, SIGNAL(searchReplyFrom(const QMap<QString, QVariant>&, const QHostAddress&, quint16)),
+			 dispatcher, SLOT(creditNeighbor(const QMap<QString, QVariant>&, const QHostAddress&, quint16)));
 
 	QObject::connect(dispatcher, SIGNAL(sendNeighbor(const QMap<QString, QVariant>&, quint32)),
 			 this, SLOT(sendNeighbor(const QMap<QString, QVariant> &, quint32)));
@@ -564,6 +619,18 @@ NetSocket::processFiles(const QStringList &files)
   fs.IndexFiles(files);
 }
 
+void
+NetSocket::shareDirectory(const QString& dirName, const QStringList& includes, const QStringList& excludes)
+{
+  fs.ShareDirectory(dirName, includes, excludes);
+}
+
+void
+NetSocket::cancelIndexing()
+{
+  fs.CancelIndexing();
+}
+
 void NetSocket::routeRumorTimeout()
 {
   QVariantMap udpBodyAsMap;
@@ -595,6 +662,8 @@ void NetSocket::addHost(const QString& s)
 // my vector clock to a random neighbor.
 void NetSocket::processAntiEntropyTimeout()
 {
+  if (numNeighbors() == 0)
+    return;
   
   QPair<QHostAddress, quint16> neighbor = neighborList.randomNeighbor();
   sendStatusMessage(neighbor.first, neighbor.second);
@@ -603,99 +672,174 @@ void NetSocket::processAntiEntropyTimeout()
 
 
 
-bool NetSocket::bind(QList<QString> &paxosNodes)
+bool NetSocket::parseArguments(const QStringList &args, NodeConfig *config)
 {
-	// Try to bind to each of the range myPortMin..myPortMax in turn.
-  quint16 qMyPortMin = (quint16) myPortMin;
-  quint16 qMyPortMax = (quint16) myPortMax;
+	// Pick a range of four UDP ports to try to allocate by default,
+	// computed based on my Unix user ID.
+	// This makes it trivial for up to four Peerster instances per user
+	// to find each other on the same host,
+	// barring UDP port conflicts with other applications
+	// (which are quite possible).
+	// We use the range from 32768 to 49151 for this purpose.
+  config->bindAddress = QHostAddress::Any;
+  config->portMin = 32768 + (getuid() % 4096)*4;
+  config->portMax = config->portMin + 3;
+  config->mesh = "";
+  config->noForward = false;
+  config->chunking = false;
+  config->instances = 1;
+
+  int max = args.count();
+  for(int i = 1; i < max; ++i){
+    
+    bool ok = true;
+    if (args[i] == "-paxos-nodes" || args[i] == "-peers"){
+      
+      // Both take every argument up to the next option.
+      QString option = args[i];
+      QStringList values;
+      while (i + 1 < max && !args[i+1].startsWith("-"))
+	values.append(args[++i]);
+      
+      if (option == "-paxos-nodes")
+	config->paxosNodes = values;
+      else
+	config->peers += values;
+    }
 
-  // Find and register all the neighbors. For the time being they are just those on the same
-  // host on different ports.
-  for (quint16 p = qMyPortMin; p <= qMyPortMax; p++) {
-		if (QUdpSocket::bind(p)) {
+    else if (args[i] == "-noforward")
+      config->noForward = true;
 
-		  /*			////qDebug() << "bound to UDP port " << p;
+    else if (args[i] == "-cdc")
+      config->chunking = true;
 
-			if (p == qMyPortMin){
-			  
+    else if (args[i] == "-bind" && i + 1 < max)
+      ok = config->bindAddress.setAddress(args[++i]);
 
-			  neighborList.addNeighbor(QHostAddress::LocalHost, p + 1);
-		
-			  
-			}
+    else if (args[i] == "-port" && i + 1 < max){
+      config->portMin = config->portMax = args[++i].toUShort(&ok);
+    }
+    
+    else if (args[i] == "-port-range" && i + 2 < max){
+      bool okMax;
+      config->portMin = args[++i].toUShort(&ok);
+      config->portMax = args[++i].toUShort(&okMax);
+      ok = ok && okMax && config->portMin <= config->portMax;
+    }
 
-			else if (p == qMyPortMin + 1){
+    else if (args[i] == "-mesh" && i + 1 < max){
+      config->mesh = args[++i];
+      ok = config->mesh == "full" || config->mesh == "ring" || config->mesh == "none";
+    }
 
+    else if (args[i] == "-peers-file" && i + 1 < max){
+      
+      QFile file(args[++i]);
+      ok = file.open(QIODevice::ReadOnly | QIODevice::Text);
+      
+      QTextStream in(&file);
+      while (ok && !in.atEnd()){
+	
+	QString line = in.readLine().trimmed();
+	if (!line.isEmpty() && !line.startsWith("#"))
+	  config->peers.append(line);
+      }
+    }
 
-			  neighborList.addNeighbor(QHostAddress::LocalHost, p - 1);
-			  neighborList.addNeighbor(QHostAddress::LocalHost, p + 1);
+    else if (args[i] == "-instances" && i + 1 < max){
+      config->instances = args[++i].toInt(&ok);
+      ok = ok && config->instances >= 1;
+    }
 
-			}
+    else
+      qDebug() << "Ignoring argument " << args[i];
 
-			else if (p == qMyPortMin + 2){
-	
-			  neighborList.addNeighbor(QHostAddress::LocalHost, p - 1);
-			  neighborList.addNeighbor(QHostAddress::LocalHost, p + 1);
+    if (!ok){
+      qDebug() << "Bad or incomplete argument " << args[i];
+      return false;
+    }
+  }
 
-			}
+  // Fully meshing a large range over loopback doesn't scale,
+  // only do it for small ranges unless asked to.
+  if (config->mesh.isEmpty())
+    config->mesh = (config->portMax - config->portMin < 4) ? "full" : "ring";
 
-			else if (p == qMyPortMin + 3){
+  return true;
+}
 
-			  neighborList.addNeighbor(QHostAddress::LocalHost, p - 1);
-			}
-			
-		  */	
-		  
-		  qDebug() << "port: " << p;
-			for (quint16 q = qMyPortMin; q <= qMyPortMax; q++) {
-			  
-			  if (p != q){			    
-			    //neighbors.append(QPair<QHostAddress, quint16>(QHostAddress::LocalHost, q));
-			    neighborList.addNeighbor(QHostAddress::LocalHost, q);
-			    
-			  }
-			  			  
-			}
-			
-		  
-			noForward = false;	
+// Register the other ports of our range as neighbors, following
+// the configured mesh.
+void NetSocket::addRangeNeighbors()
+{
+  quint16 p = localPort();
+  quint16 qMyPortMin = (quint16) myPortMin;
+  quint16 qMyPortMax = (quint16) myPortMax;
+  
+  QHostAddress local = config.bindAddress;
+  if (local == QHostAddress::Any)
+    local = QHostAddress::LocalHost;
 
-			QStringList args = QCoreApplication::arguments();
-			
-			int max = args.count();
-			bool inPaxos = false;
-			bool donePaxos = false;
-			
-			qDebug() << args.count();
-			
-			for(int i = 1; i < max; ++i){
-			  
-			  if (!inPaxos && !donePaxos && (args[i] == "-paxos-nodes"))
-			    inPaxos = true;
-
-			  else if(inPaxos){	
-
-			    if (args[i][0] == '-'){
-			      inPaxos = false;
-			      donePaxos = true;
-			    }	
-			    else{
-			      qDebug() << args[i];
-			      paxosNodes.append(args[i]);			    
-			    }
-			  }		      
-			   
-			  else if (args[i] == "-noforward"){
-			    
-			    //qDebug() << "No Forwarding!!!";
-			    noForward = true;
-			  }
-			  ////qDebug() << args[i];
-			  /*
-			  else
-			  addHost(args[i]);*/
-			}
+  if (config.mesh == "full"){
+    
+    for (quint32 q = qMyPortMin; q <= qMyPortMax; q++) {
+      
+      if (p != q)
+	neighborList.addNeighbor(local, q);
+    }
+  }
+
+  // The range may be much larger than the number of nodes, link
+  // to the nearest ports that are taken on either side.
+  else if (config.mesh == "ring" && qMyPortMin != qMyPortMax){
+    
+    quint32 span = qMyPortMax - qMyPortMin + 1;
+    quint16 prev = p;
+    quint16 next = p;
+
+    for (quint32 i = 1; i < span && prev == p; i++) {
+      quint16 q = qMyPortMin + (p - qMyPortMin + span - i) % span;
+      if (portInUse(q))
+	prev = q;
+    }
+    for (quint32 i = 1; i < span && next == p; i++) {
+      quint16 q = qMyPortMin + (p - qMyPortMin + i) % span;
+      if (portInUse(q))
+	next = q;
+    }
+    
+    if (prev != p)
+      neighborList.addNeighbor(local, prev);
+    if (next != p && next != prev)
+      neighborList.addNeighbor(local, next);
+  }
+}
+
+// Someone, most likely another node, is bound to this port.
+bool NetSocket::portInUse(quint16 port)
+{
+  if (port == localPort())
+    return true;
+
+  QUdpSocket probe;
+  return !probe.bind(config.bindAddress, port);
+}
+
+bool NetSocket::bind(QList<QString> &paxosNodes)
+{
+	// Try to bind to each of the range myPortMin..myPortMax in turn.
+  quint16 qMyPortMin = (quint16) myPortMin;
+  quint16 qMyPortMax = (quint16) myPortMax;
+
+  // Find and register all the neighbors: those on the same host in
+  // our port range, plus the configured bootstrap peers.
+  for (quint32 p = qMyPortMin; p <= qMyPortMax; p++) {
+		if (QUdpSocket::bind(config.bindAddress, p)) {
+
+		  qDebug() << "port: " << p;
+		  neighborList.addHosts(config.peers);
 
+		  paxosNodes = config.paxosNodes;
 
 			qDebug() << "Num paxos nodes =" << paxosNodes.count();
 			if(paxosNodes.count() == 0){
@@ -723,6 +867,10 @@ bool NetSocket::bind(QList<QString> &paxosNodes)
 			router->me = myNameString;
 			
 			fileRequests = new FileRequests(myNameString);
+
+			// Bring back the files we shared last time.
+			fs.SetChunking(config.chunking);
+			fs.LoadIndex("files-index-" + myNameString + ".dat");
 			
 
 			connect(fileRequests, SIGNAL(sendDownloadMsg(const QMap<QString, QVariant>&, const QString&)),
@@ -733,6 +881,9 @@ bool NetSocket::bind(QList<QString> &paxosNodes)
 
 			connect(router, SIGNAL(toFileRequests(const QMap<QString, QVariant> &)),
 				fileRequests, SLOT(processReply(const QMap<QString, QVariant> &)));
+
+			connect(router, SIGNAL(searchReply(const QMap<QString, QVariant> &)),
+				dispatcher, SLOT(cacheSearchReply(const QMap<QString, QVariant> &)));
 			
 			connect(dispatcher, SIGNAL(reply(const QMap<QString, QVariant>&, const QString &)),
 				router, SLOT(sendMap(const QMap<QString, QVariant>&, const QString&)));
@@ -745,8 +896,8 @@ bool NetSocket::bind(QList<QString> &paxosNodes)
 		}
 	}
 
-	////qDebug() << "Oops, no ports in my default range " << myPortMin
-  //<< "-" << myPortMax << " available";
+	qDebug() << "Oops, no ports in my range " << myPortMin
+		 << "-" << myPortMax << " available";
 	return false;
 }
 
@@ -879,7 +1030,7 @@ void NetSocket::newRumor()
 
   rumorTimer.stop();  
   
-  if(anythingHot){
+  if(anythingHot && numNeighbors() > 0){
     if (!noForward || !hotMessage.contains("ChatText")){
 
       QPair<QHostAddress, quint16> neighbor = neighborList.randomNeighbor();
@@ -1066,7 +1217,7 @@ void NetSocket::newStatus(const QVariantMap& message,
     
       ////qDebug() << "NetSocket::newStatus -- tie!!!";
       // Flip a coin
-      if (qrand() % 2){
+      if (qrand() % 2 && numNeighbors() > 0){
       
       
 	////qDebug() << "NetSocket::newStatus -- got heads! try to find next neighbor";
@@ -1112,6 +1263,12 @@ NetSocket::numNeighbors()
   return neighborList.getAllNeighbors().count();
 }
 
+QList<QPair<QHostAddress, quint16> >
+NetSocket::neighbors()
+{
+  return neighborList.getAllNeighbors();
+}
+
 void NetSocket::sendNeighbor(const QVariantMap &msg, quint32 neighbor)
 {
   QPair<QHostAddress, quint16> addr = neighborList.getAllNeighbors()[neighbor];
@@ -1214,6 +1371,10 @@ void NetSocket::readData()
 	
       //qDebug() << "private message";
 
+      // Remember which neighbors searches pay off through.
+      if (items.contains("SearchReply"))
+	emit searchReplyFrom(items, senderAddress, port);
+
       router->receiveMessage(items);
     
       ////qDebug() << "Unexpected Message";
@@ -1224,7 +1385,7 @@ void NetSocket::readData()
 	     items.contains("Search") &&
 	     items.contains("Budget")){
       qDebug() << "sending to dispatcher";
-      emit toDispatcher(items);
+      emit toDispatcher(items, senderAddress, port);
     }
   
     ++count;
@@ -1283,10 +1444,46 @@ int main(int argc, char **argv)
 
 	
 	// Create a UDP network socket
-	NetSocket sock;
+	NodeConfig config;
+	if (!NetSocket::parseArguments(QCoreApplication::arguments(), &config))
+		exit(1);
+
+	NetSocket sock(config);
 	QList<QString> paxosList;
 	if (!sock.bind(paxosList))
 		exit(1);
+
+	// Any further logical nodes run headless on the following
+	// free ports of the range, named after the first one.
+	QList<NetSocket *> instances;
+	for(int i = 1; i < config.instances; ++i){
+	  
+	  NodeConfig instanceConfig = config;
+	  instanceConfig.paxosNodes[0] += "-" + QString::number(i);
+	  
+	  NetSocket *instance = new NetSocket(instanceConfig);
+	  QList<QString> instancePaxosList;
+	  if (!instance->bind(instancePaxosList)){
+	    
+	    qDebug() << "Only bound " << i << " of " << config.instances << " instances";
+	    delete instance;
+	    break;
+	  }
+	  instances.append(instance);
+	}
+
+	// Only now are all our ports taken, the ring can skip the
+	// free ones. The headless nodes stay out of Paxos: the other
+	// processes don't know their names, so a membership with them
+	// in it would differ from theirs and quorums wouldn't overlap.
+	// Paxos runs on the configured -paxos nodes only.
+	sock.addRangeNeighbors();
+	for(int i = 0; i < instances.count(); ++i){
+
+	  NetSocket *instance = instances[i];
+	  instance->addRangeNeighbors();
+	  QTimer::singleShot(0, instance, SLOT(routeRumorTimeout()));
+	}
 	
 	qDebug() << "num nodes paxos =" << paxosList.count();
 	
@@ -1305,6 +1502,12 @@ int main(int argc, char **argv)
 
 	QObject::connect(&fileDialog, SIGNAL(indexFiles(const QStringList&)),
 			 &sock, SLOT(processFiles(const QStringList&)));
+	QObject::connect(&fileDialog, SIGNAL(shareDirectory(const QString&, const QStringList&, const QStringList&)),
+			 &sock, SLOT(shareDirectory(const QString&, const QStringList&, const QStringList&)));
+	QObject::connect(&fileDialog, SIGNAL(cancelIndexing()),
+			 &sock, SLOT(cancelIndexing()));
+	QObject::connect(&sock, SIGNAL(indexProgress(const QString&, qint64, qint64)),
+			 &fileDialog, SLOT(indexProgress(const QString&, qint64, qint64)));
 	QObject::connect(&dialog, SIGNAL(sendMessage(const QString&)),
 			 &sock, SLOT(gotSendMessage(const QString&)));
 
@@ -22,6 +22,7 @@
 #include <QFileDialog>
 #include <QStringList>
 #include <QTabWidget>
+#include <QLabel>
 
 #include <paxos.hh>
 #include <files.hh>
@@ -145,6 +146,12 @@ public slots:
   void
   filesSelected(const QStringList & files);
 
+  void
+  dirButtonClicked();
+
+  void
+  indexProgress(const QString& fileName, qint64 done, qint64 total);
+
 
 
 signals:
@@ -152,6 +159,12 @@ signals:
   void
   indexFiles(const QStringList& ans);					
 
+  void
+  shareDirectory(const QString& dirName, const QStringList& includes, const QStringList& excludes);
+
+  void
+  cancelIndexing();
+
 
   
   void
@@ -165,6 +178,11 @@ private:
   
   QFileDialog *fileMenu;
   QPushButton *fileButton;
+  QPushButton *dirButton;
+  QLineEdit *includeEdit;
+  QLineEdit *excludeEdit;
+  QPushButton *cancelButton;
+  QLabel *indexStatus;
   FileRequests *m_fr;
   QLineEdit *text;
   QHash<QString, DownloadBox *> activeRequests;
@@ -253,17 +271,51 @@ private:
 };
 
 
+// Startup options, parsed once from the command line:
+//
+//   -paxos-nodes name [name ...]  our name followed by the other paxos nodes
+//   -noforward                    don't forward chat messages
+//   -bind addr                    address to bind to (default: any)
+//   -port p                       bind exactly this port
+//   -port-range min max           try the ports min..max in turn
+//   -mesh full|ring|none          how to link up with the other ports in the range
+//   -peers host:port [...]        bootstrap neighbors
+//   -peers-file file              bootstrap neighbors, one host:port per line
+//   -instances n                  bind n logical nodes in this process, the
+//                                 extra ones headless and outside Paxos
+//   -cdc                          cut shared files at content-defined boundaries
+struct NodeConfig
+{
+  QHostAddress bindAddress;
+  quint16 portMin;
+  quint16 portMax;
+  QString mesh;
+  QStringList peers;
+  QList<QString> paxosNodes;
+  bool noForward;
+  bool chunking;
+  int instances;
+};
+
 class NetSocket : public QUdpSocket
 {
 	Q_OBJECT
 
 public:
-	NetSocket();
+	NetSocket(const NodeConfig &config);
 
-	// Bind this socket to a Peerster-specific default port.
+  // Fill config from the command line, false if it is malformed.
+  static bool parseArguments(const QStringList &args, NodeConfig *config);
+
+	// Bind this socket to the first free port of the configured range.
   bool bind(QList<QString> &nodes);
+
+  // Register the other ports of our range as neighbors, once every
+  // logical node of the process has bound.
+  void addRangeNeighbors();
   
         quint32 numNeighbors();
+        QList<QPair<QHostAddress, quint16> > neighbors();
         
         FileRequests *fileRequests;
 	Router *router;
@@ -281,6 +333,8 @@ public slots:
   void processAntiEntropyTimeout();
   
   void processFiles (const QStringList& files);
+  void shareDirectory(const QString& dirName, const QStringList& includes, const QStringList& excludes);
+  void cancelIndexing();
 
   void routeRumorTimeout();
 
@@ -301,7 +355,13 @@ signals:
   
   void startRouteRumorTimer(int msec);
 
-  void toDispatcher(const QMap<QString, QVariant>& msg);
+  void toDispatcher(const QMap<QString, QVariant>& msg, const QHostAddress& sender, quint16 senderPort);
+
+  // A search reply passed through us, coming from this neighbor.
+  void searchReplyFrom(const QMap<QString, QVariant>& reply, const QHostAddress& sender, quint16 senderPort);
+
+  // Progress of the background file indexer.
+  void indexProgress(const QString& fileName, qint64 done, qint64 total);
   //void processFiles(const QStringList & files);
 
 private:
@@ -348,6 +408,7 @@ private:
   
   bool checkVector(const QVariantMap& vect);
   void addUnknownOrigins(const QVariantMap &message);
+  bool portInUse(quint16 port);
 
   bool expectedRumor(const QVariantMap& rumor, QString* origin, quint32* expected);
   bool updateVector(const QVariantMap& rumor, bool routeMessage);
@@ -356,6 +417,7 @@ private:
 
   QVariantMap EMPTY_VARIANT_MAP;
   
+  NodeConfig config;
   int myPortMin, myPortMax;
   //  QHostAddress localhost(QHostAddress::LocalHost);
 
@@ -2,7 +2,16 @@
 
 NeighborList::NeighborList()
 {
-  QHostInfo myInformation = QHostInfo::fromName(QHostInfo::localHostName());
+  selfKnown = false;
+
+  // Never block the constructor on name resolution, find out our
+  // own address in the background instead.
+  QHostInfo::lookupHost(QHostInfo::localHostName(),
+			this, SLOT(lookedUpSelf(const QHostInfo&)));
+}
+
+void NeighborList::lookedUpSelf(const QHostInfo& myInformation)
+{
   QList<QHostAddress> myAddresses = myInformation.addresses();
   
   for(int i = 0; i < myAddresses.count(); ++i){
@@ -18,8 +27,23 @@ NeighborList::NeighborList()
       }
     }
   }
-  
 
+  // Hosts given before the answer came in weren't checked against
+  // it, drop the ones that are us.
+  for(int i = 0; i < unchecked.count(); ++i){
+
+    if (!myIP.isEmpty() && unchecked[i].first.toString() == myIP){
+      qDebug() << "NeighborList: " << myIP << ":" << unchecked[i].second << " is us, dropped";
+      neighbors.removeAll(unchecked[i]);
+    }
+  }
+  unchecked.clear();
+  selfKnown = true;
+
+  // Nor should cached answers bring us back.
+  QHash<QString, ResolvedHost>::iterator it = resolverCache.begin();
+  for(; it != resolverCache.end() && !myIP.isEmpty(); ++it)
+    it.value().addresses.removeAll(QHostAddress(myIP));
 }
 
 QPair<QHostAddress, quint16> NeighborList::randomNeighbor()
@@ -90,81 +114,139 @@ void NeighborList::addHost(const QString& s)
       
       QPair<QHostAddress, quint16> peer(addr, (quint16)port);
       neighbors.append(peer);
+      if (!selfKnown)
+	unchecked.append(peer);
     }
 
   }
   
   // The ip address wasn't properly parsed, maybe it's a hostname?
   else{
+    
+    resolve(parts[0], (quint16)port);
+  }  
 
+}
 
-    if (pendingLookups.contains(parts[0])){
-      
-      if ((pendingLookups[parts[0]]).indexOf(port) >= 0){
-
-	return;
-      }
+/*
+ * Add a batch of "(ipaddr|hostname):port" entries, e.g. a bootstrap
+ * peer list. Hostnames are resolved concurrently, at most
+ * DNS_MAX_INFLIGHT at a time, and a hostname shared by several
+ * entries is only looked up once.
+ */
+void NeighborList::addHosts(const QStringList& hosts)
+{
+  for(int i = 0; i < hosts.count(); ++i)
+    addHost(hosts[i]);
+}
 
-      else{
-	
-	pendingLookups[parts[0]].append(port);
+/*
+ * Resolve hostName and add it as a neighbor on port. Answers
+ * (including failures) are cached, so repeated requests for the
+ * same host never go back to the resolver until the entry expires.
+ */
+void NeighborList::resolve(const QString& hostName, quint16 port)
+{
+  if (resolverCache.contains(hostName)){
+    
+    ResolvedHost cached = resolverCache[hostName];
+    if (cached.expires > QDateTime::currentDateTime()){
+      
+      if (cached.failed){
+	qDebug() << "NeighborList::resolve -- cached lookup failure for " << hostName;
 	return;
       }
-
-    }
-
-    else {
       
-      //pendingLookups[parts[0]] = *(new QList<quint16>());
-      pendingLookups[parts[0]].append(port);
-      qDebug() << "aha! this works!";
-      QHostInfo::lookupHost(parts[0], this, SLOT(lookedUpHost(const QHostInfo&)));
+      for(int i = 0; i < cached.addresses.count(); ++i){
+	addNeighbor(cached.addresses[i], port);
+	if (!selfKnown)
+	  unchecked.append(qMakePair(cached.addresses[i], port));
+      }
       return;
     }
     
-  }  
+    resolverCache.remove(hostName);
+  }
+  
+  if (pendingLookups.contains(hostName)){
+    
+    if (pendingLookups[hostName].indexOf(port) < 0)
+      pendingLookups[hostName].append(port);
+    return;
+  }
+  
+  pendingLookups[hostName].append(port);
+  lookupQueue.append(hostName);
+  startLookups();
+}
 
+// Keep up to DNS_MAX_INFLIGHT lookups running.
+void NeighborList::startLookups()
+{
+  while (inflightLookups.count() < DNS_MAX_INFLIGHT && !lookupQueue.isEmpty()){
+    
+    QString hostName = lookupQueue.takeFirst();
+    int id = QHostInfo::lookupHost(hostName, this, SLOT(lookedUpHost(const QHostInfo&)));
+    inflightLookups[id] = hostName;
+  }
 }
 
 void NeighborList::lookedUpHost(const QHostInfo& host)
 {
-  if (host.error() != QHostInfo::NoError) {
-    qDebug() << "NetSocket::lookedUpHost -- lookup failed for " << host.hostName();
+  QString hostName = host.hostName();
+  if (inflightLookups.contains(host.lookupId()))
+    hostName = inflightLookups.take(host.lookupId());
+  
+  QList<QHostAddress> addresses;
+  bool failed = host.error() != QHostInfo::NoError;
+  
+  if (failed) {
+    qDebug() << "NetSocket::lookedUpHost -- lookup failed for " << hostName;
 
   }
 
   else {
     
-    if (!host.addresses().isEmpty()){
+    for(int i = 0; i < host.addresses().count(); ++i){
       
-      for(int i = 0; i < host.addresses().count(); ++i){
-	
-	QHostAddress curr = host.addresses()[i];
+      QHostAddress curr = host.addresses()[i];
+      
+      if (checkIfWellFormedIP(curr.toString())){
 	
-	if (checkIfWellFormedIP(curr.toString())){
-	  
-	  if (myIP != curr.toString() && "127.0.0.1" != curr.toString()){
-	    
-	    for(int i = 0; i < pendingLookups[host.hostName()].count(); ++i){
-
-	      
-
-	      QPair<QHostAddress, quint16> peer(curr,pendingLookups[host.hostName()][i]);
-
-	      qDebug() << "Added Neighbor " << host.hostName() << " " << peer;
-	      neighbors.append(peer);
-	    }
-	  
-	  }
-	  break;
-	}
-
+	if (myIP != curr.toString() && "127.0.0.1" != curr.toString())
+	  addresses.append(curr);
+	break;
       }
     }
+  }
+  
+  ResolvedHost entry;
+  entry.addresses = addresses;
+  entry.failed = failed;
+  entry.expires = QDateTime::currentDateTime().addMSecs(failed ?
+							 DNS_NEGATIVE_TTL :
+							 DNS_POSITIVE_TTL);
+  resolverCache[hostName] = entry;
+  
+  addResolved(hostName, addresses);
+  startLookups();
+}
 
+// Hand the ports waiting on hostName over to the neighbor list.
+void NeighborList::addResolved(const QString& hostName, const QList<QHostAddress>& addresses)
+{
+  QList<quint16> ports = pendingLookups.take(hostName);
+  
+  for(int i = 0; i < addresses.count(); ++i){
+    
+    for(int j = 0; j < ports.count(); ++j){
+      
+      qDebug() << "Added Neighbor " << hostName << " " << addresses[i] << ":" << ports[j];
+      addNeighbor(addresses[i], ports[j]);
+      if (!selfKnown)
+	unchecked.append(qMakePair(addresses[i], ports[j]));
+    }
   }
-  pendingLookups.remove(host.hostName());
-  qDebug() << pendingLookups;
 }
 
 
@@ -3,13 +3,29 @@
 
 #include <QObject>
 #include <QMap>
+#include <QHash>
 #include <QList>
 #include <QPair>
+#include <QDateTime>
 #include <QHostAddress>
 #include <QHostInfo>
 #include <QString>
 #include <QStringList>
 
+#define DNS_POSITIVE_TTL 300000   // How long (ms) a successful lookup stays cached
+#define DNS_NEGATIVE_TTL 30000    // How long (ms) a failed lookup stays cached
+#define DNS_MAX_INFLIGHT 32       // Maximum number of concurrent lookups
+
+// A cached answer for a hostname. A failed lookup is kept as a
+// negative entry; a name that only resolved to ourselves or the
+// loopback is a successful lookup with no usable address.
+struct ResolvedHost
+{
+  QList<QHostAddress> addresses;
+  QDateTime expires;
+  bool failed;
+};
+
 class NeighborList : public QObject
 {
   Q_OBJECT
@@ -23,14 +39,29 @@ public:
 
 public slots:
   void addHost(const QString& s);
+  void addHosts(const QStringList& hosts);
   void lookedUpHost(const QHostInfo& info);
+  void lookedUpSelf(const QHostInfo& info);
   
 private:
   bool checkIfWellFormedIP(const QString& addr);
+
+  void resolve(const QString& hostName, quint16 port);
+  void startLookups();
+  void addResolved(const QString& hostName, const QList<QHostAddress>& addresses);
   
   QMap<QString, QList<quint16> > pendingLookups;
+  QList<QString> lookupQueue;
+  QHash<int, QString> inflightLookups;
+  QHash<QString, ResolvedHost> resolverCache;
+
   QList<QPair<QHostAddress, quint16> > neighbors;
   QString myIP;
+
+  // Hosts added before our own address was known, they may turn
+  // out to be us.
+  QList<QPair<QHostAddress, quint16> > unchecked;
+  bool selfKnown;
 };
 
 #endif
@@ -12,5 +12,10 @@ CONFIG += debug crypto
 
 
 # Input
-HEADERS += main.hh neighbors.hh router.hh helper.hh files.hh dispatcher.hh filerequests.hh paxos.hh
-SOURCES += main.cc neighbors.cc router.cc helper.cc files.cc dispatcher.cc filerequests.cc paxos.cc proposer.cc acceptor.cc
+HEADERS += main.hh neighbors.hh router.hh helper.hh files.hh dispatcher.hh filerequests.hh paxos.hh indexer.hh sha256.hh searchindex.hh blockindex.hh walker.hh blockcache.hh diskio.hh blockserver.hh
+SOURCES += main.cc neighbors.cc router.cc helper.cc files.cc dispatcher.cc filerequests.cc paxos.cc proposer.cc acceptor.cc indexer.cc sha256.cc searchindex.cc blockindex.cc walker.cc blockcache.cc diskio.cc blockserver.cc
+
+# Asynchronous disk I/O uses io_uring where the kernel headers have it.
+exists(/usr/include/linux/io_uring.h) {
+  DEFINES += HAVE_IO_URING
+}
@@ -5,8 +5,6 @@
 
 #include "main.hh"
 
-#define HOP_LIMIT 10
-
 Router::Router(NetSocket *socket, bool nf)
 {
   sock = socket;
@@ -78,6 +76,18 @@ Router::sendMessage(const QString& message,const QString& destination)
 
 
 
+// Next hop towards destination, false if we have no route.
+bool
+Router::route(const QString& destination, QHostAddress *address, quint16 *port)
+{
+  if (!routingTable.contains(destination))
+    return false;
+
+  *address = routingTable[destination].first;
+  *port = routingTable[destination].second;
+  return true;
+}
+
 void
 Router::sendMap(const QMap<QString, QVariant>& msg, const QString& destination)
 {
@@ -113,16 +123,20 @@ Router::receiveMessage(QVariantMap& msg)
   QString destination = msg["Dest"].toString();
   int hopLimit = msg["HopLimit"].toInt();
   
+  // Search replies are worth remembering wherever they're going.
+  if (msg.contains("SearchReply") && msg.contains("MatchNames") && msg.contains("MatchIDs"))
+    emit searchReply(msg);
 
   if (destination == me){
     
     if (msg.contains("ChatText"))
       emit privateMessage(msg["ChatText"].toString(), msg["Origin"].toString());
-    else if (msg.contains("BlockRequest")){
+    else if (msg.contains("BlockRequest") || msg.contains("BlockList") || msg.contains("BlockRange")){
       //qDebug() << "Got block request, sending to dispatcher";
       emit blockRequest(msg);
     }
     else if ((msg.contains("BlockReply") && msg.contains("Data")) ||
+	     (msg.contains("BlockBusy") && msg.contains("RetryAfter")) ||
 	     (msg.contains("SearchReply") && msg.contains("MatchNames") && msg.contains("MatchIDs"))){
       //qDebug() << "Got reply, sending to filerequests";
       emit toFileRequests(msg);
@@ -11,6 +11,8 @@ class NetSocket;
 #include <QMap>
 #include <QVariantMap>
 
+#define HOP_LIMIT 10
+
 class Router : public QObject
 {
   Q_OBJECT
@@ -24,6 +26,9 @@ processRumor(const QVariantMap& rumor,
      	       const QHostAddress& sender,
      	       const quint16 port);
 
+bool
+route(const QString& destination, QHostAddress *address, quint16 *port);
+
 public slots:
 
 void
@@ -52,6 +57,9 @@ blockRequest(const QMap<QString, QVariant>&msg);
 
 void
 toPaxos(const QMap<QString, QVariant>&msg);
+
+void
+searchReply(const QMap<QString, QVariant>&msg);
   
 private:
   QHash<QString, QPair<QHostAddress, quint16> > routingTable;
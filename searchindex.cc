@@ -0,0 +1,238 @@
+#include <queue>
+#include <vector>
+#include <functional>
+
+#include <QtAlgorithms>
+#include <QPair>
+
+#include <searchindex.hh>
+
+// How much a keyword is worth to a file, depending on how it matched.
+#define EXACT_WEIGHT 3.0
+#define PREFIX_WEIGHT 2.0
+#define FUZZY_WEIGHT 1.0
+
+SearchIndex::SearchIndex()
+{
+
+}
+
+QStringList
+SearchIndex::Tokenize(const QString& name)
+{
+  QStringList tokens;
+  QString current;
+
+  for(int i = 0; i <= name.size(); ++i){
+
+    if (i < name.size() && name[i].isLetterOrNumber()){
+      current += name[i].toLower();
+    }
+    else if (!current.isEmpty()){
+      if (!tokens.contains(current))
+	tokens.append(current);
+      current.clear();
+    }
+  }
+  return tokens;
+}
+
+QStringList
+SearchIndex::Trigrams(const QString& term)
+{
+  QStringList ret;
+  QString padded = "$" + term + "$";
+
+  for(int i = 0; i + 3 <= padded.size(); ++i)
+    ret.append(padded.mid(i, 3));
+  return ret;
+}
+
+void
+SearchIndex::Insert(quint32 id, const QString& name)
+{
+  QStringList tokens = Tokenize(name);
+
+  for(int i = 0; i < tokens.count(); ++i){
+
+    if (!postings.contains(tokens[i])){
+
+      QStringList grams = Trigrams(tokens[i]);
+      for(int j = 0; j < grams.count(); ++j)
+	trigrams[grams[j]].insert(tokens[i]);
+    }
+
+    QList<quint32>& list = postings[tokens[i]];
+    QList<quint32>::iterator it = qLowerBound(list.begin(), list.end(), id);
+
+    if (it == list.end() || *it != id)
+      list.insert(it, id);
+  }
+}
+
+void
+SearchIndex::Remove(quint32 id, const QString& name)
+{
+  QStringList tokens = Tokenize(name);
+
+  for(int i = 0; i < tokens.count(); ++i){
+
+    if (!postings.contains(tokens[i]))
+      continue;
+
+    QList<quint32>& list = postings[tokens[i]];
+    QList<quint32>::iterator it = qBinaryFind(list.begin(), list.end(), id);
+    if (it != list.end())
+      list.erase(it);
+
+    if (list.isEmpty()){
+
+      postings.remove(tokens[i]);
+
+      QStringList grams = Trigrams(tokens[i]);
+      for(int j = 0; j < grams.count(); ++j){
+	trigrams[grams[j]].remove(tokens[i]);
+	if (trigrams[grams[j]].isEmpty())
+	  trigrams.remove(grams[j]);
+      }
+    }
+  }
+}
+
+// Levenshtein distance, or limit + 1 as soon as it must exceed limit.
+int
+SearchIndex::EditDistance(const QString& a, const QString& b, int limit)
+{
+  if (qAbs(a.size() - b.size()) > limit)
+    return limit + 1;
+
+  QList<int> previous, current;
+  for(int j = 0; j <= b.size(); ++j)
+    previous.append(j);
+
+  for(int i = 1; i <= a.size(); ++i){
+
+    current.clear();
+    current.append(i);
+    int rowMin = i;
+
+    for(int j = 1; j <= b.size(); ++j){
+
+      int cost = (a[i-1] == b[j-1]) ? 0 : 1;
+      int d = qMin(qMin(previous[j] + 1, current[j-1] + 1), previous[j-1] + cost);
+      current.append(d);
+      rowMin = qMin(rowMin, d);
+    }
+
+    if (rowMin > limit)
+      return limit + 1;
+    previous = current;
+  }
+  return previous[b.size()];
+}
+
+// Credit every file containing term with weight, keeping the
+// best weight each file got for the current keyword.
+void
+SearchIndex::ScoreTerm(const QString& term, double weight, QHash<quint32, double> *best)
+{
+  QList<quint32> list = postings.value(term);
+
+  for(int i = 0; i < list.count(); ++i){
+    if (best->value(list[i], 0.0) < weight)
+      (*best)[list[i]] = weight;
+  }
+}
+
+void
+SearchIndex::ScoreKeyword(const QString& keyword, QHash<quint32, double> *best)
+{
+  // Exact and prefix matches: walk the sorted terms from the keyword on.
+  QMap<QString, QList<quint32> >::const_iterator it = postings.lowerBound(keyword);
+  for(int n = 0; it != postings.constEnd() && it.key().startsWith(keyword) && n < MAX_PREFIX_TERMS; ++it, ++n){
+
+    if (it.key() == keyword)
+      ScoreTerm(it.key(), EXACT_WEIGHT, best);
+    else
+      ScoreTerm(it.key(), PREFIX_WEIGHT * keyword.size() / it.key().size(), best);
+  }
+
+  if (keyword.size() < FUZZY_MIN_LENGTH)
+    return;
+
+  // Typos: a single edit changes at most three trigrams, so a
+  // candidate must share the rest of them with the keyword.
+  int limit = (keyword.size() >= FUZZY_MIN_LENGTH2) ? 2 : 1;
+  QStringList grams = Trigrams(keyword);
+  int required = qMax(1, grams.count() - 3*limit);
+
+  QHash<QString, int> shared;
+  for(int i = 0; i < grams.count(); ++i){
+
+    QHash<QString, QSet<QString> >::const_iterator terms = trigrams.constFind(grams[i]);
+    if (terms == trigrams.constEnd())
+      continue;
+
+    QSet<QString>::const_iterator term;
+    for(term = terms.value().constBegin(); term != terms.value().constEnd(); ++term)
+      shared[*term] += 1;
+  }
+
+  QHash<QString, int>::const_iterator candidate;
+  for(candidate = shared.constBegin(); candidate != shared.constEnd(); ++candidate){
+
+    if (candidate.value() < required || candidate.key().startsWith(keyword))
+      continue;
+
+    int distance = EditDistance(keyword, candidate.key(), limit);
+    if (distance <= limit)
+      ScoreTerm(candidate.key(), FUZZY_WEIGHT / distance, best);
+  }
+}
+
+QList<quint32>
+SearchIndex::Query(const QString& query, int maxResults)
+{
+  QStringList keyWords = Tokenize(query);
+  QHash<quint32, double> scores;
+  QHash<quint32, int> matched;
+
+  for(int i = 0; i < keyWords.count(); ++i){
+
+    QHash<quint32, double> best;
+    ScoreKeyword(keyWords[i], &best);
+
+    QHash<quint32, double>::const_iterator it;
+    for(it = best.constBegin(); it != best.constEnd(); ++it){
+      scores[it.key()] += it.value();
+      matched[it.key()] += 1;
+    }
+  }
+
+  // Keep the maxResults best files in a min-heap. A file matching
+  // every keyword always beats one that doesn't.
+  typedef QPair<double, quint32> Scored;
+  std::priority_queue<Scored, std::vector<Scored>, std::greater<Scored> > heap;
+
+  QHash<quint32, double>::const_iterator it;
+  for(it = scores.constBegin(); it != scores.constEnd() && maxResults > 0; ++it){
+
+    double score = it.value();
+    if (matched[it.key()] == keyWords.count())
+      score += EXACT_WEIGHT * keyWords.count();
+
+    if ((int)heap.size() < maxResults)
+      heap.push(Scored(score, it.key()));
+    else if (heap.top().first < score){
+      heap.pop();
+      heap.push(Scored(score, it.key()));
+    }
+  }
+
+  QList<quint32> ret;
+  while (!heap.empty()){
+    ret.prepend(heap.top().second);
+    heap.pop();
+  }
+  return ret;
+}
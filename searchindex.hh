@@ -0,0 +1,62 @@
+#ifndef SEARCHINDEX_HH
+#define SEARCHINDEX_HH
+
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <QHash>
+#include <QMap>
+#include <QSet>
+
+#define MAX_PREFIX_TERMS 64   // Most index terms a single prefix keyword expands to
+#define FUZZY_MIN_LENGTH 4    // Shortest keyword we allow one typo in
+#define FUZZY_MIN_LENGTH2 8   // Shortest keyword we allow two typos in
+
+/*
+ * Inverted index over the names of the shared files. A name is cut
+ * into lower-case tokens at every character that isn't a letter or
+ * a digit, and each token keeps a sorted posting list of the ids of
+ * the files whose name contains it.
+ *
+ * A keyword matches a token exactly, as a prefix of it, or within
+ * one or two typos (found through a trigram index over the tokens).
+ * Every file gets a relevance score from how well each keyword
+ * matched, and only the best maxResults are kept.
+ */
+class SearchIndex
+{
+public:
+  SearchIndex();
+
+  void
+  Insert(quint32 id, const QString& name);
+
+  void
+  Remove(quint32 id, const QString& name);
+
+  // The best matching files, best first, at most maxResults.
+  QList<quint32>
+  Query(const QString& query, int maxResults);
+
+  static QStringList
+  Tokenize(const QString& name);
+
+private:
+
+  void
+  ScoreKeyword(const QString& keyword, QHash<quint32, double> *best);
+
+  void
+  ScoreTerm(const QString& term, double weight, QHash<quint32, double> *best);
+
+  static QStringList
+  Trigrams(const QString& term);
+
+  static int
+  EditDistance(const QString& a, const QString& b, int limit);
+
+  QMap<QString, QList<quint32> > postings;
+  QHash<QString, QSet<QString> > trigrams;
+};
+
+#endif // SEARCHINDEX_HH
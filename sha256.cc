@@ -0,0 +1,470 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86 1
+#endif
+
+#include <sha256.hh>
+
+/*
+ * Three compression functions share the padding and bookkeeping
+ * code below:
+ *
+ *   CompressPortable: plain C++, any CPU.
+ *   CompressShaNi:    SHA extensions, one buffer.
+ *   CompressAvx2x8:   AVX2, SHA256_LANES independent buffers,
+ *                     one 32-bit lane each.
+ *
+ * Each engine is compiled for its own target, so the binary runs
+ * everywhere and only picks an engine the CPU supports.
+ */
+
+static const quint32 K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const quint32 INITIAL_STATE[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+typedef void (*CompressFunction)(quint32 *state, const unsigned char *data, size_t blocks);
+
+static inline quint32
+LoadBigEndian(const unsigned char *p)
+{
+  return ((quint32)p[0] << 24) | ((quint32)p[1] << 16) | ((quint32)p[2] << 8) | (quint32)p[3];
+}
+
+static inline void
+StoreBigEndian(unsigned char *p, quint32 v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static inline quint32
+Rotr(quint32 x, int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+static void
+CompressPortable(quint32 *state, const unsigned char *data, size_t blocks)
+{
+  quint32 w[64];
+
+  for(; blocks > 0; --blocks, data += 64){
+
+    for(int t = 0; t < 16; ++t)
+      w[t] = LoadBigEndian(data + 4*t);
+
+    for(int t = 16; t < 64; ++t){
+      quint32 s0 = Rotr(w[t-15], 7) ^ Rotr(w[t-15], 18) ^ (w[t-15] >> 3);
+      quint32 s1 = Rotr(w[t-2], 17) ^ Rotr(w[t-2], 19) ^ (w[t-2] >> 10);
+      w[t] = w[t-16] + s0 + w[t-7] + s1;
+    }
+
+    quint32 a = state[0], b = state[1], c = state[2], d = state[3];
+    quint32 e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for(int t = 0; t < 64; ++t){
+      quint32 t1 = h + (Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[t] + w[t];
+      quint32 t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }
+}
+
+/*
+ * Build the padded tail of a message of the given length, whose
+ * last (length % 64) bytes are at data. Returns the number of
+ * blocks written to tail (1 or 2).
+ */
+static int
+PadTail(const unsigned char *data, quint64 length, unsigned char *tail)
+{
+  int rest = length % 64;
+  int blocks = (rest + 9 <= 64) ? 1 : 2;
+
+  memset(tail, 0, 128);
+  memcpy(tail, data, rest);
+  tail[rest] = 0x80;
+
+  quint64 bits = length * 8;
+  for(int i = 0; i < 8; ++i)
+    tail[64*blocks - 1 - i] = bits >> (8*i);
+
+  return blocks;
+}
+
+static QByteArray
+Digest(const quint32 *state)
+{
+  QByteArray digest(32, 0);
+  for(int i = 0; i < 8; ++i)
+    StoreBigEndian((unsigned char *)digest.data() + 4*i, state[i]);
+  return digest;
+}
+
+#ifdef SHA256_X86
+
+__attribute__((target("sha,sse4.1")))
+static void
+CompressShaNi(quint32 *state, const unsigned char *data, size_t blocks)
+{
+  const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  // The instructions want the state as ABEF/CDGH.
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  for(; blocks > 0; --blocks, data += 64){
+
+    __m128i abefSave = state0;
+    __m128i cdghSave = state1;
+    __m128i w[4];
+
+    for(int i = 0; i < 4; ++i)
+      w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16*i)), MASK);
+
+    // Four rounds per step, the schedule stays three steps ahead.
+    for(int i = 0; i < 16; ++i){
+
+      __m128i msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&K[4*i]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+
+      if (i < 12){
+	__m128i next = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+	next = _mm_add_epi32(next, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+	w[i & 3] = _mm_sha256msg2_epu32(next, w[(i + 3) & 3]);
+      }
+    }
+
+    state0 = _mm_add_epi32(state0, abefSave);
+    state1 = _mm_add_epi32(state1, cdghSave);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+  _mm_storeu_si128((__m128i *)&state[0], state0);
+  _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+#define ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+/*
+ * One 64-byte block for each of SHA256_LANES messages. state holds
+ * word i of every lane in state[i], blocks[l] is lane l's block.
+ */
+__attribute__((target("avx2")))
+static void
+CompressAvx2x8(__m256i *state, const unsigned char *const *blocks)
+{
+  __m256i w[64];
+
+  for(int t = 0; t < 16; ++t)
+    w[t] = _mm256_set_epi32(LoadBigEndian(blocks[7] + 4*t), LoadBigEndian(blocks[6] + 4*t),
+			    LoadBigEndian(blocks[5] + 4*t), LoadBigEndian(blocks[4] + 4*t),
+			    LoadBigEndian(blocks[3] + 4*t), LoadBigEndian(blocks[2] + 4*t),
+			    LoadBigEndian(blocks[1] + 4*t), LoadBigEndian(blocks[0] + 4*t));
+
+  for(int t = 16; t < 64; ++t){
+    __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(w[t-15], 7), ROTR8(w[t-15], 18)),
+				  _mm256_srli_epi32(w[t-15], 3));
+    __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(w[t-2], 17), ROTR8(w[t-2], 19)),
+				  _mm256_srli_epi32(w[t-2], 10));
+    w[t] = _mm256_add_epi32(_mm256_add_epi32(w[t-16], s0), _mm256_add_epi32(w[t-7], s1));
+  }
+
+  __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+  __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+
+  for(int t = 0; t < 64; ++t){
+    __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(e, 6), ROTR8(e, 11)), ROTR8(e, 25));
+    __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+    __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, s1),
+				  _mm256_add_epi32(_mm256_add_epi32(ch, _mm256_set1_epi32(K[t])), w[t]));
+    __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(a, 2), ROTR8(a, 13)), ROTR8(a, 22));
+    __m256i maj = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)),
+				   _mm256_and_si256(b, c));
+    __m256i t2 = _mm256_add_epi32(s0, maj);
+
+    h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+    d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+  }
+
+  state[0] = _mm256_add_epi32(state[0], a); state[1] = _mm256_add_epi32(state[1], b);
+  state[2] = _mm256_add_epi32(state[2], c); state[3] = _mm256_add_epi32(state[3], d);
+  state[4] = _mm256_add_epi32(state[4], e); state[5] = _mm256_add_epi32(state[5], f);
+  state[6] = _mm256_add_epi32(state[6], g); state[7] = _mm256_add_epi32(state[7], h);
+}
+
+#undef ROTR8
+
+/*
+ * Hash up to SHA256_LANES whole messages at once, leaving the
+ * final state of message l in out[l]. Lanes whose message is
+ * shorter than the longest one hash zero blocks once they are
+ * done, so equally sized messages waste nothing.
+ */
+__attribute__((target("avx2")))
+static void
+HashLanesAvx2(const unsigned char *const *data, const quint64 *lengths, int lanes,
+	      quint32 (*out)[8])
+{
+  static const unsigned char ZERO_BLOCK[64] = { 0 };
+
+  unsigned char tails[SHA256_LANES][128];
+  quint64 fullBlocks[SHA256_LANES];
+  quint64 totalBlocks[SHA256_LANES];
+  quint64 maxBlocks = 0;
+
+  for(int l = 0; l < lanes; ++l){
+
+    fullBlocks[l] = lengths[l] / 64;
+    totalBlocks[l] = fullBlocks[l] + PadTail(data[l] + 64*fullBlocks[l], lengths[l], tails[l]);
+    if (totalBlocks[l] > maxBlocks)
+      maxBlocks = totalBlocks[l];
+  }
+
+  __m256i state[8];
+  for(int i = 0; i < 8; ++i)
+    state[i] = _mm256_set1_epi32(INITIAL_STATE[i]);
+
+  for(quint64 j = 0; j < maxBlocks; ++j){
+
+    const unsigned char *blocks[SHA256_LANES];
+    for(int l = 0; l < SHA256_LANES; ++l){
+
+      if (l >= lanes || j >= totalBlocks[l])
+	blocks[l] = ZERO_BLOCK;
+      else if (j < fullBlocks[l])
+	blocks[l] = data[l] + 64*j;
+      else
+	blocks[l] = tails[l] + 64*(j - fullBlocks[l]);
+    }
+
+    CompressAvx2x8(state, blocks);
+
+    // Pick up the lanes that just finished.
+    quint32 words[8][SHA256_LANES];
+    bool stored = false;
+    for(int l = 0; l < lanes; ++l){
+
+      if (j + 1 != totalBlocks[l])
+	continue;
+
+      if (!stored){
+	for(int i = 0; i < 8; ++i)
+	  _mm256_storeu_si256((__m256i *)words[i], state[i]);
+	stored = true;
+      }
+
+      for(int i = 0; i < 8; ++i)
+	out[l][i] = words[i][l];
+    }
+  }
+}
+
+static bool
+CpuHasShaNi()
+{
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return false;
+  bool sha = (ebx >> 29) & 1;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  bool sse41 = (ecx >> 19) & 1;
+  bool ssse3 = (ecx >> 9) & 1;
+
+  return sha && sse41 && ssse3;
+}
+
+static bool
+CpuHasAvx2()
+{
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+
+  // The OS must save the YMM registers for us.
+  bool osxsave = (ecx >> 27) & 1;
+  if (!osxsave)
+    return false;
+
+  unsigned int xcr0Low, xcr0High;
+  __asm__ ("xgetbv" : "=a" (xcr0Low), "=d" (xcr0High) : "c" (0));
+  if ((xcr0Low & 6) != 6)
+    return false;
+
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (ebx >> 5) & 1;
+}
+
+static const bool HAS_SHA_NI = CpuHasShaNi();
+static const bool HAS_AVX2 = CpuHasAvx2();
+
+#else
+
+static const bool HAS_SHA_NI = false;
+static const bool HAS_AVX2 = false;
+
+#endif // SHA256_X86
+
+static CompressFunction
+SelectCompress()
+{
+#ifdef SHA256_X86
+  if (HAS_SHA_NI)
+    return CompressShaNi;
+#endif
+  return CompressPortable;
+}
+
+static const CompressFunction Compress = SelectCompress();
+
+
+
+
+Sha256::Sha256()
+{
+  Reset();
+}
+
+void
+Sha256::Reset()
+{
+  memcpy(state, INITIAL_STATE, sizeof(state));
+  length = 0;
+  buffered = 0;
+}
+
+void
+Sha256::Update(const char *data, int size)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  length += size;
+
+  if (buffered > 0){
+
+    int take = qMin(64 - buffered, size);
+    memcpy(buffer + buffered, p, take);
+    buffered += take;
+    p += take;
+    size -= take;
+
+    if (buffered < 64)
+      return;
+
+    Compress(state, buffer, 1);
+    buffered = 0;
+  }
+
+  size_t blocks = size / 64;
+  if (blocks > 0){
+    Compress(state, p, blocks);
+    p += blocks * 64;
+    size -= blocks * 64;
+  }
+
+  memcpy(buffer, p, size);
+  buffered = size;
+}
+
+QByteArray
+Sha256::Final()
+{
+  unsigned char tail[128];
+  int blocks = PadTail(buffer, length, tail);
+  Compress(state, tail, blocks);
+
+  QByteArray digest = Digest(state);
+  Reset();
+  return digest;
+}
+
+QByteArray
+Sha256::Hash(const char *data, int size)
+{
+  Sha256 context;
+  context.Update(data, size);
+  return context.Final();
+}
+
+QByteArray
+Sha256::Hash(const QByteArray& data)
+{
+  return Hash(data.constData(), data.size());
+}
+
+/*
+ * Hash each buffer independently. Without SHA extensions the
+ * buffers go through the AVX2 engine SHA256_LANES at a time.
+ */
+QList<QByteArray>
+Sha256::HashMany(const QList<QByteArray>& buffers)
+{
+  QList<QByteArray> digests;
+
+#ifdef SHA256_X86
+  if (!HAS_SHA_NI && HAS_AVX2){
+
+    for(int first = 0; first < buffers.count(); first += SHA256_LANES){
+
+      int lanes = qMin(SHA256_LANES, buffers.count() - first);
+      const unsigned char *data[SHA256_LANES];
+      quint64 lengths[SHA256_LANES];
+      quint32 states[SHA256_LANES][8];
+
+      for(int l = 0; l < lanes; ++l){
+	data[l] = (const unsigned char *)buffers[first + l].constData();
+	lengths[l] = buffers[first + l].size();
+      }
+
+      HashLanesAvx2(data, lengths, lanes, states);
+
+      for(int l = 0; l < lanes; ++l)
+	digests.append(Digest(states[l]));
+    }
+    return digests;
+  }
+#endif
+
+  for(int i = 0; i < buffers.count(); ++i)
+    digests.append(Hash(buffers[i]));
+  return digests;
+}
+
+const char *
+Sha256::Engine()
+{
+  if (HAS_SHA_NI)
+    return "sha-ni";
+  if (HAS_AVX2)
+    return "avx2-x8";
+  return "portable";
+}
@@ -0,0 +1,54 @@
+#ifndef SHA256_HH
+#define SHA256_HH
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QList>
+
+#define SHA256_LANES 8      // Number of buffers the multi-buffer engine hashes at once
+
+/*
+ * SHA-256 with runtime CPU dispatch. Single buffers use the SHA
+ * extensions when the CPU has them, otherwise the portable code.
+ * HashMany() hashes independent buffers SHA256_LANES at a time with
+ * AVX2 when there are no SHA extensions. All engines produce the
+ * same digests as QCA's "sha256".
+ *
+ * A Sha256 object is plain data, it can be kept around and Reset()
+ * instead of being set up again for every block.
+ */
+class Sha256
+{
+public:
+  Sha256();
+
+  void
+  Reset();
+
+  void
+  Update(const char *data, int size);
+
+  QByteArray
+  Final();
+
+  static QByteArray
+  Hash(const char *data, int size);
+
+  static QByteArray
+  Hash(const QByteArray& data);
+
+  static QList<QByteArray>
+  HashMany(const QList<QByteArray>& buffers);
+
+  // Name of the engine picked for this CPU, for debugging.
+  static const char *
+  Engine();
+
+private:
+  quint32 state[8];
+  unsigned char buffer[64];
+  quint64 length;
+  int buffered;
+};
+
+#endif // SHA256_HH
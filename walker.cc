@@ -0,0 +1,182 @@
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QRegExp>
+#include <QMutexLocker>
+
+#include <walker.hh>
+
+WalkWorker::WalkWorker(DirectoryWalker *walker)
+{
+  m_walker = walker;
+}
+
+void
+WalkWorker::run()
+{
+  WalkDir dir;
+  while (m_walker->NextDir(&dir))
+    m_walker->ListDir(dir);
+}
+
+
+
+DirectoryWalker::DirectoryWalker()
+{
+  pool.setMaxThreadCount(WALK_THREADS);
+  running = 0;
+  generation = 0;
+}
+
+DirectoryWalker::~DirectoryWalker()
+{
+  Cancel();
+  pool.waitForDone();
+}
+
+void
+DirectoryWalker::Walk(const QString& root, const QStringList& includes, const QStringList& excludes,
+		      bool recursive)
+{
+  WalkDir dir;
+  dir.path = root;
+  dir.includes = includes;
+  dir.excludes = excludes;
+  dir.recursive = recursive;
+
+  QMutexLocker locker(&lock);
+  dirs.append(dir);
+
+  if (running < WALK_THREADS){
+    ++running;
+    pool.start(new WalkWorker(this));
+  }
+}
+
+QStringList
+DirectoryWalker::Take(int max)
+{
+  QMutexLocker locker(&lock);
+
+  QStringList taken = files.mid(0, max);
+  files = files.mid(taken.count());
+
+  notFull.wakeAll();
+  return taken;
+}
+
+bool
+DirectoryWalker::Idle()
+{
+  QMutexLocker locker(&lock);
+  return running == 0 && files.isEmpty();
+}
+
+// Forget every queued directory and file, listings in progress are dropped.
+void
+DirectoryWalker::Cancel()
+{
+  QMutexLocker locker(&lock);
+  ++generation;
+  dirs.clear();
+  files.clear();
+  notFull.wakeAll();
+}
+
+bool
+DirectoryWalker::Matches(const QString& name, const QStringList& patterns)
+{
+  for(int i = 0; i < patterns.count(); ++i){
+
+    QRegExp pattern(patterns[i], Qt::CaseSensitive, QRegExp::Wildcard);
+    if (pattern.exactMatch(name))
+      return true;
+  }
+  return false;
+}
+
+// Take the next directory, or retire the worker when there is none.
+bool
+DirectoryWalker::NextDir(WalkDir *dir)
+{
+  QMutexLocker locker(&lock);
+
+  if (dirs.isEmpty()){
+
+    if (--running == 0)
+      emit walkFinished();
+    return false;
+  }
+
+  *dir = dirs.takeFirst();
+  return true;
+}
+
+void
+DirectoryWalker::ListDir(const WalkDir& dir)
+{
+  lock.lock();
+  int listing = generation;
+  lock.unlock();
+
+  QDir current(dir.path);
+  QFileInfoList entries = current.entryInfoList(QDir::Dirs | QDir::Files | QDir::Hidden | QDir::NoDotAndDotDot,
+						QDir::Name);
+
+  QStringList found;
+  QList<WalkDir> subdirs;
+
+  for(int i = 0; i < entries.count(); ++i){
+
+    const QFileInfo& entry = entries[i];
+    if (Matches(entry.fileName(), dir.excludes))
+      continue;
+
+    // Symlinked directories could loop back into the tree.
+    if (entry.isDir()){
+      if (entry.isSymLink() || !dir.recursive)
+	continue;
+
+      WalkDir subdir = dir;
+      subdir.path = entry.absoluteFilePath();
+      subdirs.append(subdir);
+    }
+    else if (entry.isFile()){
+      if (dir.includes.isEmpty() || Matches(entry.fileName(), dir.includes))
+	found.append(entry.absoluteFilePath());
+    }
+  }
+
+  lock.lock();
+  if (listing != generation){
+    lock.unlock();
+    return;
+  }
+
+  dirs += subdirs;
+  while (running < WALK_THREADS && running < dirs.count()){
+    ++running;
+    pool.start(new WalkWorker(this));
+  }
+  lock.unlock();
+
+  for(int i = 0; i < found.count(); ++i)
+    AddFile(found[i], listing);
+}
+
+// Queue a file for FileStore, waiting while the queue is full.
+void
+DirectoryWalker::AddFile(const QString& fileName, int listing)
+{
+  QMutexLocker locker(&lock);
+
+  while (files.count() >= WALK_QUEUE && listing == generation)
+    notFull.wait(&lock);
+
+  if (listing != generation)
+    return;
+
+  files.append(fileName);
+  if (files.count() == 1)
+    emit filesReady();
+}
@@ -0,0 +1,105 @@
+#ifndef WALKER_HH
+#define WALKER_HH
+
+#include <QObject>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QString>
+#include <QStringList>
+#include <QList>
+
+#define WALK_THREADS 4      // Number of directories listed at the same time
+#define WALK_QUEUE 1024     // Most files found but not yet taken by FileStore
+
+class DirectoryWalker;
+
+// A directory waiting to be listed, with the patterns of the
+// tree it belongs to.
+struct WalkDir
+{
+  QString path;
+  QStringList includes;
+  QStringList excludes;
+  bool recursive;   // Its subdirectories are listed too
+};
+
+class WalkWorker : public QRunnable
+{
+public:
+  WalkWorker(DirectoryWalker *walker);
+
+  void
+  run();
+
+private:
+  DirectoryWalker *m_walker;
+};
+
+/*
+ * Walks directory trees on a small thread pool. Each worker takes a
+ * directory off a shared queue, lists it, queues the subdirectories
+ * and hands the files on. Found files wait in a queue bounded by
+ * WALK_QUEUE, workers block once it is full, so a huge tree doesn't
+ * get ahead of the hashing.
+ *
+ * Include and exclude patterns are shell wildcards. Excludes apply
+ * to directories and files, includes (if any) to files only.
+ */
+class DirectoryWalker : public QObject
+{
+  Q_OBJECT
+
+public:
+  DirectoryWalker();
+  ~DirectoryWalker();
+
+  void
+  Walk(const QString& root, const QStringList& includes, const QStringList& excludes,
+       bool recursive = true);
+
+  // Up to max files found so far, from the main thread.
+  QStringList
+  Take(int max);
+
+  bool
+  Idle();
+
+  void
+  Cancel();
+
+  static bool
+  Matches(const QString& name, const QStringList& patterns);
+
+signals:
+
+  void
+  filesReady();
+
+  void
+  walkFinished();
+
+private:
+
+  friend class WalkWorker;
+
+  bool
+  NextDir(WalkDir *dir);
+
+  void
+  ListDir(const WalkDir& dir);
+
+  void
+  AddFile(const QString& fileName, int listing);
+
+  QThreadPool pool;
+  QMutex lock;
+  QWaitCondition notFull;
+  QList<WalkDir> dirs;
+  QStringList files;
+  int running;
+  int generation;
+};
+
+#endif // WALKER_HH